@@ -13,9 +13,9 @@ local function nop() end
 
 local driver = {name = "lunatik", open = nop, release = nop}
 
-function driver:read()
-	local result = self.result
-	self.result = nil
+function driver:read(_, _, file)
+	local result = file.result
+	file.result = nil
 	return result
 end
 
@@ -23,12 +23,12 @@ local function result(_, ...)
 	return select("#", ...) > 0 and tostring(select(1, ...)) or ''
 end
 
-function driver:write(buf)
+function driver:write(buf, _, file)
 	local ok, err = load(buf)
 	if ok then
 		err = result(pcall(ok))
 	end
-	self.result = err
+	file.result = err
 end
 
 driver.__runtimes = lunatik.runtimes()
@@ -19,8 +19,8 @@ local blacklist = {
 }
 
 local function get_domain(skb, off)
-	local _, _, name = skb:getstring(off):find("([^\0]*)")
-	return name
+	local len = skb:strlen(off)
+	return len > 0 and skb:getstring(off, len) or ""
 end
 
 local function check_blacklist(name)
@@ -13,9 +13,9 @@ local dns = 0x35
 
 local common = {}
 
-local function get_domain(skb, off)
-	local _, nameoff, name = skb:getstring(off):find("([^\0]*)")
-	return name, nameoff + 1
+local function match_domain(skb, off, domain)
+	local len = skb:strlen(off)
+	return len == #domain and skb:compare(off, domain), len + 1
 end
 
 function common.hook(skb, thoff, target_dns, target_ip, dst_ip)
@@ -26,20 +26,26 @@ function common.hook(skb, thoff, target_dns, target_ip, dst_ip)
 
 	local srcport = linux.ntoh16(skb:getuint16(thoff))
 	if srcport == dns then
+		local udpcsum = thoff + 6
 		local dnsoff = thoff + 8
 		local nanswers = linux.ntoh16(skb:getuint16(dnsoff + 6))
 
 		-- check the domain name
 		dnsoff = dnsoff + 12
-		local domainname, nameoff = get_domain(skb, dnsoff)
+		local match, nameoff = match_domain(skb, dnsoff, target_dns)
 
-		if domainname == target_dns then
+		if match then
 			dnsoff = dnsoff + nameoff + 4 -- skip over type, label fields
 			-- iterate over answers
 			for i = 1, nanswers do
 				local atype = linux.hton16(skb:getuint16(dnsoff + 2))
 				if atype == 1 then
-					skb:setuint32(dnsoff + 12, linux.hton32(target_ip))
+					local addroff = dnsoff + 12
+					local old, new = skb:getuint32(addroff), linux.hton32(target_ip)
+					skb:setuint32(addroff, new)
+					if skb:getuint16(udpcsum) ~= 0 then
+						skb:protocsumreplace4(udpcsum, old, new)
+					end
 				end
 				dnsoff = dnsoff + 16
 			end
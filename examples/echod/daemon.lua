@@ -22,6 +22,9 @@ local server = inet.tcp()
 server:bind(inet.localhost, 1337)
 server:listen()
 
+local poll = socket.poll()
+poll:add(server.socket, 0)
+
 local n = 1
 local worker = "echod/worker"
 
@@ -36,7 +39,7 @@ local function daemon()
 			thread.run(runtime, worker .. n)
 			n = n + 1
 		elseif session == errno.AGAIN then
-			linux.schedule(100)
+			poll:wait() -- until a connection arrives (or the thread is stopped)
 		end
 	end
 	control:setbyte(1, 0) -- dead
@@ -0,0 +1,36 @@
+--
+-- SPDX-FileCopyrightText: (c) 2024 Ring Zero Desenvolvimento de Software LTDA
+-- SPDX-License-Identifier: MIT OR GPL-2.0-only
+--
+
+-- loaded by inet.tcp.shard() on each CPU; e.g.,
+-- local threads = inet.tcp.shard("examples/sharded", "0.0.0.0", 8080)
+
+local socket = require("socket")
+local inet   = require("socket.inet")
+local thread = require("thread")
+local linux  = require("linux")
+
+local shouldstop = thread.shouldstop
+local sock = socket.sock
+local errno = linux.errno
+
+return function (server, cpu)
+	local server = inet.tcp:new{socket = server}
+	local poll = socket.poll()
+	poll:add(server.socket, 0)
+
+	return function ()
+		while not shouldstop() do
+			local ok, session = pcall(server.accept, server, sock.NONBLOCK)
+			if ok then
+				session:send("served by cpu " .. cpu .. "\n")
+				session:close()
+			elseif session == errno.AGAIN then
+				poll:wait() -- until a connection arrives (or the thread is stopped)
+			end
+		end
+		poll:close()
+	end
+end
+
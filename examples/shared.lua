@@ -34,6 +34,9 @@ local server = inet.tcp()
 server:bind(inet.localhost, 90)
 server:listen()
 
+local poll = socket.poll()
+poll:add(server.socket, 0)
+
 local shouldstop = thread.shouldstop
 local task = linux.task
 local sock = socket.sock
@@ -69,7 +72,7 @@ local function daemon()
 		if ok then
 			handle(session)
 		elseif session == errno.AGAIN then
-			linux.schedule(100)
+			poll:wait() -- until a connection arrives (or the thread is stopped)
 		end
 	end
 	print("stopping shared...")
@@ -6,6 +6,8 @@
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/skbuff.h>
+#include <net/checksum.h>
 
 #include <lua.h>
 #include <lualib.h>
@@ -18,6 +20,7 @@
 typedef struct luadata_s {
 	char *ptr;
 	size_t size;
+	struct sk_buff *skb;
 	uint8_t opt;
 } luadata_t;
 
@@ -95,6 +98,125 @@ static int luadata_setstring(lua_State *L)
 	return 0;
 }
 
+static inline const char *luadata_memmem(const char *ptr, size_t size, const char *pattern, size_t length)
+{
+	const char *end = ptr + size - length;
+	const char *p = ptr;
+
+	while (p <= end && (p = memchr(p, pattern[0], end - p + 1)) != NULL) {
+		if (memcmp(p, pattern, length) == 0)
+			return p;
+		p++;
+	}
+	return NULL;
+}
+
+static int luadata_find(lua_State *L)
+{
+	luadata_t *data = luadata_check(L, 1);
+	lua_Integer offset = luaL_optinteger(L, 3, 0);
+	lua_Integer limit = luaL_optinteger(L, 4, data->size - offset);
+	const char *ptr, *found;
+	size_t length;
+
+	luadata_checkbounds(L, 3, data->size, offset, limit);
+	ptr = data->ptr + offset;
+
+	if (lua_type(L, 2) == LUA_TNUMBER)
+		found = memchr(ptr, (int)(uint8_t)lua_tointeger(L, 2), limit);
+	else {
+		const char *pattern = luaL_checklstring(L, 2, &length);
+		luaL_argcheck(L, length > 0, 2, "empty pattern");
+		found = (lua_Integer)length <= limit ? luadata_memmem(ptr, limit, pattern, length) : NULL;
+	}
+
+	if (found == NULL)
+		lua_pushnil(L);
+	else
+		lua_pushinteger(L, (lua_Integer)(found - data->ptr));
+	return 1;
+}
+
+static int luadata_strlen(lua_State *L)
+{
+	luadata_t *data = luadata_check(L, 1);
+	lua_Integer offset = luaL_checkinteger(L, 2);
+	lua_Integer max = luaL_optinteger(L, 3, data->size - offset);
+	luadata_checkbounds(L, 2, data->size, offset, max);
+
+	lua_pushinteger(L, (lua_Integer)strnlen(data->ptr + offset, max));
+	return 1;
+}
+
+static int luadata_compare(lua_State *L)
+{
+	size_t length;
+	luadata_t *data = luadata_check(L, 1);
+	lua_Integer offset = luaL_checkinteger(L, 2);
+	const char *str = luaL_checklstring(L, 3, &length);
+	int fits = offset >= 0 && offset + length <= data->size;
+
+	lua_pushboolean(L, fits && memcmp(data->ptr + offset, str, length) == 0);
+	return 1;
+}
+
+static int luadata_csum(lua_State *L)
+{
+	luadata_t *data = luadata_check(L, 1);
+	lua_Integer offset = luaL_checkinteger(L, 2);
+	lua_Integer length = luaL_checkinteger(L, 3);
+	__wsum seed = (__force __wsum)(u32)luaL_optinteger(L, 4, 0);
+	luadata_checkbounds(L, 2, data->size, offset, length);
+
+	lua_pushinteger(L, (lua_Integer)(__force u32)csum_partial(data->ptr + offset, length, seed));
+	return 1;
+}
+
+static inline __sum16 *luadata_checksum(lua_State *L, luadata_t *data)
+{
+	lua_Integer offset = luaL_checkinteger(L, 2);
+	luadata_checkbounds(L, 2, data->size, offset, sizeof(__sum16));
+	luadata_checkwritable(L, data);
+	return (__sum16 *)(data->ptr + offset);
+}
+
+#define LUADATA_NEWCSUM_REPLACER(N, B)						\
+static int luadata_csumreplace##N(lua_State *L)					\
+{										\
+	luadata_t *data = luadata_check(L, 1);					\
+	__sum16 *sum = luadata_checksum(L, data);				\
+	__be##B from = (__force __be##B)(u##B)luaL_checkinteger(L, 3);		\
+	__be##B to = (__force __be##B)(u##B)luaL_checkinteger(L, 4);		\
+										\
+	csum_replace##N(sum, from, to);						\
+	return 0;								\
+}										\
+										\
+static int luadata_protocsumreplace##N(lua_State *L)				\
+{										\
+	luadata_t *data = luadata_check(L, 1);					\
+	__sum16 *sum = luadata_checksum(L, data);				\
+	__be##B from = (__force __be##B)(u##B)luaL_checkinteger(L, 3);		\
+	__be##B to = (__force __be##B)(u##B)luaL_checkinteger(L, 4);		\
+	bool pseudohdr = lua_toboolean(L, 5);					\
+										\
+	if (data->skb != NULL)							\
+		inet_proto_csum_replace##N(sum, data->skb, from, to, pseudohdr);	\
+	else									\
+		csum_replace##N(sum, from, to);					\
+	return 0;								\
+}
+
+LUADATA_NEWCSUM_REPLACER(2, 16);
+LUADATA_NEWCSUM_REPLACER(4, 32);
+
+static int luadata_csumfold(lua_State *L)
+{
+	__wsum csum = (__force __wsum)(u32)luaL_checkinteger(L, 1);
+	lua_pushinteger(L, (lua_Integer)(__force u16)csum_fold(csum));
+	return 1;
+}
+
 static int luadata_length(lua_State *L)
 {
 	luadata_t *data = luadata_check(L, 1);
@@ -118,6 +240,7 @@ static void luadata_release(void *private)
 
 static const luaL_Reg luadata_lib[] = {
 	{"new", luadata_lnew},
+	{"csumfold", luadata_csumfold},
 	{NULL, NULL}
 };
 
@@ -151,6 +274,14 @@ static const luaL_Reg luadata_mt[] = {
 #endif
 	{"getstring", luadata_getstring},
 	{"setstring", luadata_setstring},
+	{"find", luadata_find},
+	{"strlen", luadata_strlen},
+	{"compare", luadata_compare},
+	{"csum", luadata_csum},
+	{"csumreplace2", luadata_csumreplace2},
+	{"csumreplace4", luadata_csumreplace4},
+	{"protocsumreplace2", luadata_protocsumreplace2},
+	{"protocsumreplace4", luadata_protocsumreplace4},
 	{NULL, NULL}
 };
 
@@ -169,6 +300,7 @@ static int luadata_lnew(lua_State *L)
 
 	data->ptr = lunatik_checkalloc(L, size);
 	data->size = size;
+	data->skb = NULL;
 	data->opt = LUADATA_OPT_FREE;
 	return 1; /* object */
 }
@@ -183,13 +315,14 @@ lunatik_object_t *luadata_new(void *ptr, size_t size, bool sleep, uint8_t opt)
 		luadata_t *data = (luadata_t *)object->private;
 		data->ptr = ptr;
 		data->size = size;
+		data->skb = NULL;
 		data->opt = opt;
 	}
 	return object;
 }
 EXPORT_SYMBOL(luadata_new);
 
-int luadata_reset(lunatik_object_t *object, void *ptr, size_t size, uint8_t opt)
+static int luadata_doreset(lunatik_object_t *object, void *ptr, size_t size, struct sk_buff *skb, uint8_t opt)
 {
 	luadata_t *data;
 
@@ -203,13 +336,50 @@ int luadata_reset(lunatik_object_t *object, void *ptr, size_t size, uint8_t opt)
 
 	data->ptr = ptr;
 	data->size = size;
+	data->skb = skb;
 	data->opt = opt & LUADATA_OPT_KEEP ? data->opt : opt;
 
 	lunatik_unlock(object);
 	return 0;
 }
+
+int luadata_reset(lunatik_object_t *object, void *ptr, size_t size, uint8_t opt)
+{
+	return luadata_doreset(object, ptr, size, NULL, opt);
+}
 EXPORT_SYMBOL(luadata_reset);
 
+/* only the linear part is exposed; callers linearize the skb to expose the whole packet (skb->len) */
+int luadata_resetskb(lunatik_object_t *object, struct sk_buff *skb, uint8_t opt)
+{
+	return luadata_doreset(object, skb->data, skb_headlen(skb), skb, opt);
+}
+EXPORT_SYMBOL(luadata_resetskb);
+
+char *luadata_checkbuffer(lua_State *L, int ix, size_t *size, bool writable)
+{
+	lunatik_object_t *object = *(lunatik_object_t **)luaL_checkudata(L, ix, luadata_class.name);
+	luadata_t *data;
+
+	lunatik_argchecknull(L, object, ix);
+	data = luadata_check(L, ix);
+	luaL_argcheck(L, !writable || !(data->opt & LUADATA_OPT_READONLY), ix, "read only");
+
+	*size = data->size;
+	return data->ptr;
+}
+EXPORT_SYMBOL(luadata_checkbuffer);
+
+/* only data objects created by data.new() own their memory, which lives as long as the object */
+char *luadata_checkowned(lua_State *L, int ix, size_t *size, bool writable)
+{
+	char *ptr = luadata_checkbuffer(L, ix, size, writable);
+
+	luaL_argcheck(L, luadata_check(L, ix)->opt & LUADATA_OPT_FREE, ix, "data doesn't own its memory");
+	return ptr;
+}
+EXPORT_SYMBOL(luadata_checkowned);
+
 static int __init luadata_init(void)
 {
 	return 0;
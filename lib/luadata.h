@@ -6,6 +6,8 @@
 #ifndef luadata_h
 #define luadata_h
 
+#include <linux/skbuff.h>
+
 #include <lunatik.h>
 
 LUNATIK_LIB(data);
@@ -19,6 +21,9 @@ LUNATIK_LIB(data);
 
 lunatik_object_t *luadata_new(void *ptr, size_t size, bool sleep, uint8_t opt);
 int luadata_reset(lunatik_object_t *object, void *ptr, size_t size, uint8_t opt);
+int luadata_resetskb(lunatik_object_t *object, struct sk_buff *skb, uint8_t opt);
+char *luadata_checkbuffer(lua_State *L, int ix, size_t *size, bool writable);
+char *luadata_checkowned(lua_State *L, int ix, size_t *size, bool writable);
 
 static inline void luadata_close(lunatik_object_t *object)
 {
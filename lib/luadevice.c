@@ -16,6 +16,12 @@
 #include <linux/mutex.h>
 #include <linux/kref.h>
 #include <linux/version.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/mm.h>
+#include <linux/ioctl.h>
+#include <linux/atomic.h>
+#include <linux/sizes.h>
 
 #include <lua.h>
 #include <lualib.h>
@@ -23,15 +29,53 @@
 
 #include <lunatik.h>
 
+#include "luadata.h"
+
 static struct class *luadevice_devclass;
 
+typedef enum luadevice_op_e {
+	LUADEVICE_OOPEN,
+	LUADEVICE_OREAD,
+	LUADEVICE_OWRITE,
+	LUADEVICE_ORELEASE,
+	LUADEVICE_OPOLL,
+	LUADEVICE_OIOCTL,
+	LUADEVICE_OMMAP,
+	LUADEVICE_NOPS,
+} luadevice_op_t;
+
+static const char *luadevice_opnames[] = {"open", "read", "write", "release", "poll", "ioctl", "mmap"};
+
+/* references are valid only on the driver's runtime */
+typedef struct luadevice_driver_s {
+	lunatik_object_t *runtime;
+	int driver; /* driver and operation references */
+	int ops[LUADEVICE_NOPS];
+	int argument; /* data object for ioctl(), read() and write() */
+	bool data; /* read() and write() exchange data objects instead of strings */
+} luadevice_driver_t;
+
 typedef struct luadevice_s {
 	struct list_head entry;
-	lunatik_object_t *runtime;
+	luadevice_driver_t main;
+	luadevice_driver_t *pool; /* open files are spread among these runtimes, if any */
+	unsigned int npool;
+	atomic_t next;
 	struct cdev *cdev;
 	dev_t devt;
+	wait_queue_head_t wait;
 } luadevice_t;
 
+/* the file context (a Lua table) is stored in the driver's registry, keyed by this struct */
+typedef struct luadevice_file_s {
+	luadevice_t *luadev;
+	luadevice_driver_t *driver;
+	char *buffer; /* bounce buffer for data objects, only used on the driver's runtime */
+	size_t size;
+} luadevice_file_t;
+
+#define LUADEVICE_MAXBUFFER	(SZ_1M)
+
 static DEFINE_MUTEX(luadevice_mutex);
 static LIST_HEAD(luadevice_list);
 
@@ -67,17 +111,22 @@ static inline luadevice_t *luadevice_find(dev_t devt)
 
 static int luadevice_new(lua_State *L);
 
-static int luadevice_fop(lua_State *L, luadevice_t *luadev, const char *fop, int nargs, int nresults)
+static int luadevice_fop(lua_State *L, luadevice_file_t *file, luadevice_op_t op, int nargs, int nresults)
 {
-	int base = lua_gettop(L) - nargs;
-	int ret = -ENXIO;
+	luadevice_driver_t *driver = file->driver;
+	const char *fop = luadevice_opnames[op];
+	int base, ret = -ENXIO;
+
+	lunatik_getregistry(L, file); /* context is the last argument */
+	nargs++;
+	base = lua_gettop(L) - nargs;
 
-	if (lunatik_getregistry(L, luadev) != LUA_TTABLE) {
+	if (lunatik_getref(L, driver->driver) != LUA_TTABLE) {
 		pr_err("%s: couldn't find driver\n", fop);
 		goto err;
 	}
 
-	if (lua_getfield(L, -1, fop) != LUA_TFUNCTION) {
+	if (lunatik_getref(L, driver->ops[op]) != LUA_TFUNCTION) {
 		lua_getfield(L, -2, "name");
 		pr_err("%s: operation isn't defined for /dev/%s\n", fop, lua_tostring(L, -1));
 		goto err;
@@ -86,7 +135,7 @@ static int luadevice_fop(lua_State *L, luadevice_t *luadev, const char *fop, int
 	lua_insert(L, base + 1); /* fop */
 	lua_insert(L, base + 2); /* driver */
 
-	if (lua_pcall(L, nargs + 1, nresults, 0) != LUA_OK) { /* fop(driver, arg1, ...) */
+	if (lua_pcall(L, nargs + 1, nresults, 0) != LUA_OK) { /* fop(driver, arg1, ..., context) */
 		pr_err("%s: %s\n", lua_tostring(L, -1), fop);
 		ret = -ECANCELED;
 		goto err;
@@ -97,20 +146,136 @@ err:
 	return ret;
 }
 
-static int luadevice_doopen(lua_State *L, luadevice_t *luadev)
+static inline void luadevice_setcontext(lua_State *L, luadevice_file_t *file, bool open)
+{
+	if (open)
+		lua_newtable(L);
+	else
+		lua_pushnil(L);
+	lunatik_setregistry(L, -1, file); /* context */
+	lua_pop(L, 1);
+}
+
+/* results are converted outside of the protected call, thus we can't raise errors here */
+static inline int luadevice_optinteger(lua_State *L, int ix, lua_Integer def, lua_Integer *result)
+{
+	int isnum = 1;
+
+	*result = lua_isnoneornil(L, ix) ? def : lua_tointegerx(L, ix, &isnum);
+	return isnum ? 0 : -EINVAL;
+}
+
+/* converts the (count, offset) results of read and write callbacks */
+static inline ssize_t luadevice_checkresult(lua_State *L, size_t len, lua_Integer def, loff_t *off)
+{
+	lua_Integer llen, pos;
+
+	if (luadevice_optinteger(L, -2, def, &llen) != 0)
+		return -EINVAL;
+
+	llen = (lua_Integer)min(len, (size_t)llen);
+	if (luadevice_optinteger(L, -1, *off + llen, &pos) != 0)
+		return -EINVAL;
+
+	*off = (loff_t)pos;
+	return (ssize_t)llen;
+}
+
+static int luadevice_doopen(lua_State *L, luadevice_file_t *file)
+{
+	int ret;
+
+	luadevice_setcontext(L, file, true);
+	if ((ret = luadevice_fop(L, file, LUADEVICE_OOPEN, 0, 0)) != 0)
+		luadevice_setcontext(L, file, false);
+	return ret;
+}
+
+static char *luadevice_getbuffer(luadevice_file_t *file, size_t *len)
+{
+	*len = min_t(size_t, *len, LUADEVICE_MAXBUFFER); /* short reads and writes are allowed */
+	if (*len > file->size) {
+		kvfree(file->buffer);
+		file->size = 0;
+		if ((file->buffer = kvmalloc(*len, GFP_KERNEL)) == NULL)
+			return NULL;
+		file->size = *len;
+	}
+	return file->buffer;
+}
+
+static lunatik_object_t *luadevice_pushdata(lua_State *L, luadevice_driver_t *driver, char *buffer, size_t size, uint8_t opt)
+{
+	lunatik_object_t *data;
+
+	if (lunatik_getref(L, driver->argument) != LUA_TUSERDATA) /* device was stopped */
+		return NULL;
+
+	data = lunatik_toobject(L, -1);
+	luadata_reset(data, buffer, size, opt);
+	return data;
+}
+
+static ssize_t luadevice_readdata(lua_State *L, luadevice_file_t *file, char *buf, size_t len, loff_t *off)
+{
+	lunatik_object_t *data;
+	char *buffer;
+	loff_t pos = *off;
+	ssize_t ret;
+
+	if ((buffer = luadevice_getbuffer(file, &len)) == NULL)
+		return -ENOMEM;
+
+	if ((data = luadevice_pushdata(L, file->driver, buffer, len, LUADATA_OPT_NONE)) == NULL)
+		return -ENXIO;
+
+	lua_pushinteger(L, *off);
+	ret = luadevice_fop(L, file, LUADEVICE_OREAD, 2, 2);
+	luadata_clear(data);
+	if (ret != 0 || (ret = luadevice_checkresult(L, len, 0, &pos)) < 0)
+		return ret;
+
+	if (copy_to_user(buf, buffer, (size_t)ret) != 0)
+		return -EFAULT;
+
+	*off = pos;
+	return ret;
+}
+
+static ssize_t luadevice_writedata(lua_State *L, luadevice_file_t *file, const char *buf, size_t len, loff_t *off)
 {
-	return luadevice_fop(L, luadev, "open", 0, 0);
+	lunatik_object_t *data;
+	char *buffer;
+	ssize_t ret;
+
+	if ((buffer = luadevice_getbuffer(file, &len)) == NULL)
+		return -ENOMEM;
+
+	if (copy_from_user(buffer, buf, len) != 0)
+		return -EFAULT;
+
+	if ((data = luadevice_pushdata(L, file->driver, buffer, len, LUADATA_OPT_READONLY)) == NULL)
+		return -ENXIO;
+
+	lua_pushinteger(L, *off);
+	ret = luadevice_fop(L, file, LUADEVICE_OWRITE, 2, 2);
+	luadata_clear(data);
+	return ret != 0 ? ret : luadevice_checkresult(L, len, len, off);
 }
 
-static ssize_t luadevice_doread(lua_State *L, luadevice_t *luadev, char *buf, size_t len, loff_t *off)
+static ssize_t luadevice_doread(lua_State *L, luadevice_file_t *file, char *buf, size_t len, loff_t *off)
 {
 	ssize_t ret;
 	size_t llen;
+	lua_Integer pos;
 	const char *lbuf;
 
+	if (file->driver->data)
+		return len > 0 ? luadevice_readdata(L, file, buf, len, off) : 0;
+
 	lua_pushinteger(L, len);
 	lua_pushinteger(L, *off);
-	if ((ret = luadevice_fop(L, luadev, "read", 2, 2)) != 0)
+	if ((ret = luadevice_fop(L, file, LUADEVICE_OREAD, 2, 2)) != 0)
 		return ret;
 
 	lbuf = lua_tolstring(L, -2, &llen);
@@ -118,17 +283,22 @@ static ssize_t luadevice_doread(lua_State *L, luadevice_t *luadev, char *buf, si
 	if (copy_to_user(buf, lbuf, llen) != 0)
 		return -EFAULT;
 
-	*off = (loff_t)luaL_optinteger(L, -1, *off + llen);
+	if (luadevice_optinteger(L, -1, *off + llen, &pos) != 0)
+		return -EINVAL;
+
+	*off = (loff_t)pos;
 	return (ssize_t)llen;
 }
 
-static ssize_t luadevice_dowrite(lua_State *L, luadevice_t *luadev, const char *buf, size_t len, loff_t *off)
+static ssize_t luadevice_dowrite(lua_State *L, luadevice_file_t *file, const char *buf, size_t len, loff_t *off)
 {
 	ssize_t ret;
 	luaL_Buffer B;
-	size_t llen;
 	char *lbuf;
 
+	if (file->driver->data)
+		return len > 0 ? luadevice_writedata(L, file, buf, len, off) : 0;
+
 	lbuf = luaL_buffinitsize(L, &B, len);
 
 	if (copy_from_user(lbuf, buf, len) != 0) {
@@ -138,36 +308,166 @@ static ssize_t luadevice_dowrite(lua_State *L, luadevice_t *luadev, const char *
 
 	luaL_pushresultsize(&B, len);
 	lua_pushinteger(L, *off);
-	if ((ret = luadevice_fop(L, luadev, "write", 2, 2)) != 0)
+	if ((ret = luadevice_fop(L, file, LUADEVICE_OWRITE, 2, 2)) != 0)
 		return ret;
 
-	llen = (size_t)luaL_optinteger(L, -2, len);
-	llen = min(len, llen);
-	*off = (loff_t)luaL_optinteger(L, -1, *off + llen);
-	return (ssize_t)llen;
+	return luadevice_checkresult(L, len, len, off);
+}
+
+static int luadevice_dorelease(lua_State *L, luadevice_file_t *file)
+{
+	int ret = luadevice_fop(L, file, LUADEVICE_ORELEASE, 0, 0);
+
+	luadevice_setcontext(L, file, false);
+	return ret;
+}
+
+#define luadevice_hasop(driver, op)	((driver)->ops[(op)] != LUA_NOREF && (driver)->ops[(op)] != LUA_REFNIL)
+
+static int luadevice_dopoll(lua_State *L, luadevice_file_t *file, __poll_t *mask)
+{
+	int ret;
+
+	/* devices without poll() are always ready, as VFS does for files without it */
+	if (!luadevice_hasop(file->driver, LUADEVICE_OPOLL)) {
+		*mask = DEFAULT_POLLMASK;
+		return 0;
+	}
+
+	if ((ret = luadevice_fop(L, file, LUADEVICE_OPOLL, 0, 1)) != 0)
+		return ret;
+
+	*mask = (__poll_t)lua_tointeger(L, -1);
+	return 0;
+}
+
+static long luadevice_doioctl(lua_State *L, luadevice_file_t *file, unsigned int cmd, unsigned long arg, char *buffer)
+{
+	size_t size = _IOC_SIZE(cmd);
+	lunatik_object_t *argument = NULL;
+	long ret;
+
+	lua_pushinteger(L, (lua_Integer)cmd);
+	if (buffer != NULL) {
+		uint8_t opt = _IOC_DIR(cmd) & _IOC_READ ? LUADATA_OPT_NONE : LUADATA_OPT_READONLY;
+		if ((argument = luadevice_pushdata(L, file->driver, buffer, size, opt)) == NULL)
+			return -ENXIO;
+	}
+	else
+		lua_pushinteger(L, (lua_Integer)arg);
+
+	if ((ret = luadevice_fop(L, file, LUADEVICE_OIOCTL, 2, 1)) == 0) {
+		lua_Integer result;
+		ret = luadevice_optinteger(L, -1, 0, &result) == 0 ? (long)result : -EINVAL;
+	}
+
+	if (argument != NULL)
+		luadata_clear(argument);
+	return ret;
+}
+
+static void luadevice_vmopen(struct vm_area_struct *vma)
+{
+	lunatik_getobject((lunatik_object_t *)vma->vm_private_data);
 }
 
-static int luadevice_dorelease(lua_State *L, luadevice_t *luadev)
+static void luadevice_vmclose(struct vm_area_struct *vma)
 {
-	return luadevice_fop(L, luadev, "release", 0, 0);
+	lunatik_putobject((lunatik_object_t *)vma->vm_private_data);
 }
 
-#define luadevice_fromfile(f)	((luadevice_t *)(f)->private_data)
-#define luadevice_run(handler, ret, f, ...)					\
-		lunatik_run(luadevice_fromfile(f)->runtime, (handler),	\
+static const struct vm_operations_struct luadevice_vmops = {
+	.open = luadevice_vmopen,
+	.close = luadevice_vmclose,
+};
+
+static int luadevice_map(lua_State *L)
+{
+	struct vm_area_struct *vma = (struct vm_area_struct *)lua_touserdata(L, 1);
+	unsigned long len = vma->vm_end - vma->vm_start;
+	bool writable = vma->vm_flags & VM_WRITE;
+	lunatik_object_t *data;
+	size_t size;
+	char *buffer = luadata_checkowned(L, 2, &size, writable); /* views might be freed while mapped */
+	int ret;
+
+	/* only whole pages of physically contiguous memory (e.g., data.new(n * PAGE_SIZE)) */
+	luaL_argcheck(L, virt_addr_valid(buffer) && PAGE_ALIGNED(buffer), 2, "data isn't page aligned");
+	luaL_argcheck(L, len <= size, 2, "data is smaller than the mapping");
+
+	if (!writable) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+		vm_flags_clear(vma, VM_MAYWRITE);
+#else
+		vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+	}
+
+	if ((ret = remap_pfn_range(vma, vma->vm_start, virt_to_phys(buffer) >> PAGE_SHIFT, len, vma->vm_page_prot)) != 0)
+		return luaL_error(L, "failed to map data (%d)", ret);
+
+	data = lunatik_checkobject(L, 2);
+	lunatik_getobject(data); /* released on munmap() */
+	vma->vm_private_data = data;
+	vma->vm_ops = &luadevice_vmops;
+	return 0;
+}
+
+static int luadevice_dommap(lua_State *L, luadevice_file_t *file, struct vm_area_struct *vma)
+{
+	int ret;
+
+	lua_pushinteger(L, (lua_Integer)(vma->vm_end - vma->vm_start));
+	lua_pushinteger(L, (lua_Integer)vma->vm_pgoff << PAGE_SHIFT);
+	if ((ret = luadevice_fop(L, file, LUADEVICE_OMMAP, 2, 1)) != 0)
+		return ret;
+
+	lua_pushcfunction(L, luadevice_map);
+	lua_insert(L, -2);
+	lua_pushlightuserdata(L, vma);
+	lua_insert(L, -2); /* stack: map, vma, data */
+	if (lua_pcall(L, 2, 0, 0) != LUA_OK) {
+		pr_err("mmap: %s\n", lua_tostring(L, -1));
+		return -EINVAL;
+	}
+	return 0;
+}
+
+#define luadevice_fromfile(f)	((luadevice_file_t *)(f)->private_data)
+#define luadevice_run(handler, ret, f, ...)						\
+		lunatik_run(luadevice_fromfile(f)->driver->runtime, (handler),	\
 			(ret), luadevice_fromfile(f), ## __VA_ARGS__)
 
+static inline luadevice_driver_t *luadevice_route(luadevice_t *luadev)
+{
+	return luadev->npool == 0 ? &luadev->main :
+		&luadev->pool[(unsigned int)atomic_inc_return(&luadev->next) % luadev->npool];
+}
+
 static int luadevice_fop_open(struct inode *inode, struct file *f)
 {
 	luadevice_t *luadev;
+	luadevice_file_t *file;
 	int ret;
 
 	if ((luadev = luadevice_find(inode->i_rdev)) == NULL)
 		return -ENXIO;
 
-	lunatik_getobject(luadev->runtime);
-	f->private_data = luadev;
+	if ((file = kmalloc(sizeof(luadevice_file_t), GFP_KERNEL)) == NULL)
+		return -ENOMEM;
+
+	file->luadev = luadev;
+	file->driver = luadevice_route(luadev);
+	file->buffer = NULL;
+	file->size = 0;
+	lunatik_getobject(file->driver->runtime);
+	f->private_data = file;
+
 	luadevice_run(luadevice_doopen, ret, f);
+	if (ret != 0) { /* release() won't be called */
+		lunatik_putobject(file->driver->runtime);
+		kfree(file);
+	}
 	return ret;
 }
 
@@ -187,9 +487,58 @@ static ssize_t luadevice_fop_write(struct file *f, const char *buf, size_t len,
 
 static int luadevice_fop_release(struct inode *inode, struct file *f)
 {
+	luadevice_file_t *file = luadevice_fromfile(f);
 	int ret;
 
 	luadevice_run(luadevice_dorelease, ret, f);
+	lunatik_putobject(file->driver->runtime);
+	kvfree(file->buffer);
+	kfree(file);
+	return ret;
+}
+
+static __poll_t luadevice_fop_poll(struct file *f, struct poll_table_struct *wait)
+{
+	__poll_t mask;
+	int ret;
+
+	poll_wait(f, &luadevice_fromfile(f)->luadev->wait, wait);
+	luadevice_run(luadevice_dopoll, ret, f, &mask);
+	return ret == 0 ? mask : EPOLLERR;
+}
+
+static long luadevice_fop_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
+{
+	size_t size = _IOC_SIZE(cmd);
+	char *buffer = NULL;
+	long ret;
+
+	/* commands encoding a size exchange their argument through a bounce buffer */
+	if (size > 0) {
+		if ((buffer = kzalloc(size, GFP_KERNEL)) == NULL)
+			return -ENOMEM;
+
+		if ((_IOC_DIR(cmd) & _IOC_WRITE) && copy_from_user(buffer, (void __user *)arg, size) != 0) {
+			ret = -EFAULT;
+			goto out;
+		}
+	}
+
+	luadevice_run(luadevice_doioctl, ret, f, cmd, arg, buffer);
+
+	if (ret >= 0 && buffer != NULL && (_IOC_DIR(cmd) & _IOC_READ) &&
+	    copy_to_user((void __user *)arg, buffer, size) != 0)
+		ret = -EFAULT;
+out:
+	kfree(buffer);
+	return ret;
+}
+
+static int luadevice_fop_mmap(struct file *f, struct vm_area_struct *vma)
+{
+	int ret;
+
+	luadevice_run(luadevice_dommap, ret, f, vma);
 	return ret;
 }
 
@@ -199,7 +548,11 @@ static struct file_operations luadevice_fops =
 	.open = luadevice_fop_open,
 	.read = luadevice_fop_read,
 	.write = luadevice_fop_write,
-	.release = luadevice_fop_release
+	.release = luadevice_fop_release,
+	.poll = luadevice_fop_poll,
+	.unlocked_ioctl = luadevice_fop_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+	.mmap = luadevice_fop_mmap,
 };
 
 static void luadevice_delete(luadevice_t *luadev)
@@ -220,10 +573,26 @@ static void luadevice_delete(luadevice_t *luadev)
 static void luadevice_release(void *private)
 {
 	luadevice_t *luadev = (luadevice_t *)private;
+	unsigned int i;
 
 	/* device might have never been stopped */
 	luadevice_delete(luadev);
-	lunatik_putobject(luadev->runtime);
+	lunatik_putobject(luadev->main.runtime);
+
+	for (i = 0; i < luadev->npool; i++)
+		if (luadev->pool[i].runtime != NULL)
+			lunatik_putobject(luadev->pool[i].runtime);
+	kfree(luadev->pool);
+}
+
+static void luadevice_unsetdriver(lua_State *L, luadevice_driver_t *driver)
+{
+	luadevice_op_t op;
+
+	lunatik_unref(L, &driver->driver);
+	for (op = 0; op < LUADEVICE_NOPS; op++)
+		lunatik_unref(L, &driver->ops[op]);
+	lunatik_unref(L, &driver->argument);
 }
 
 static int luadevice_stop(lua_State *L)
@@ -235,8 +604,106 @@ static int luadevice_stop(lua_State *L)
 	luadevice_delete(luadev);
 	lunatik_unlock(object);
 
-	if (lunatik_toruntime(L) == luadev->runtime)
+	if (lunatik_toruntime(L) == luadev->main.runtime) {
+		luadevice_unsetdriver(L, &luadev->main);
 		lunatik_unregisterobject(L, object);
+	}
+	return 0;
+}
+
+static int luadevice_wakeup(lua_State *L)
+{
+	lunatik_object_t *object = lunatik_checkobject(L, 1);
+	luadevice_t *luadev = (luadevice_t *)object->private;
+
+	lunatik_argchecknull(L, luadev, 1);
+	wake_up_interruptible(&luadev->wait);
+	return 0;
+}
+
+static void luadevice_setops(lua_State *L, int ix, luadevice_driver_t *driver)
+{
+	luadevice_op_t op;
+
+	lunatik_setref(L, ix, &driver->driver);
+	for (op = 0; op < LUADEVICE_NOPS; op++)
+		lunatik_setfieldref(L, ix, luadevice_opnames[op], &driver->ops[op]);
+
+	lua_getfield(L, ix, "data");
+	driver->data = lua_toboolean(L, -1);
+	lua_pop(L, 1); /* data */
+}
+
+static void luadevice_setdriver(lua_State *L, int ix, luadevice_driver_t *driver)
+{
+	luadevice_setops(L, ix, driver);
+
+	lunatik_requiref(L, data);
+	lunatik_cloneobject(L, lunatik_checknull(L, luadata_new(NULL, 0, true, LUADATA_OPT_NONE)));
+	lunatik_setref(L, -1, &driver->argument);
+	lua_pop(L, 1); /* argument */
+}
+
+static int luadevice_setworker(lua_State *L)
+{
+	luadevice_driver_t *driver = (luadevice_driver_t *)lua_touserdata(L, 1);
+
+	luaL_checktype(L, 2, LUA_TTABLE);
+	luadevice_setdriver(L, 2, driver);
+	return 0;
+}
+
+/* pool scripts return their driver table, which remains at the bottom of the runtime's stack */
+static int luadevice_doworker(lua_State *L, luadevice_driver_t *driver)
+{
+	lua_pushcfunction(L, luadevice_setworker);
+	lua_pushlightuserdata(L, driver);
+	lua_pushvalue(L, 1);
+	if (lua_pcall(L, 2, 0, 0) != LUA_OK) {
+		pr_err("pool: %s\n", lua_tostring(L, -1));
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static void luadevice_newpool(lua_State *L, int ix, luadevice_t *luadev)
+{
+	const char *script;
+	lua_Integer n;
+	unsigned int i;
+
+	lunatik_checkfield(L, ix, "script", LUA_TSTRING);
+	script = lua_tostring(L, -1);
+	lua_getfield(L, ix, "n");
+	n = luaL_optinteger(L, -1, num_online_cpus());
+	luaL_argcheck(L, n > 0 && n <= NR_CPUS, 1, "invalid pool size");
+
+	luadev->pool = (luadevice_driver_t *)lunatik_checkalloc(L, n * sizeof(luadevice_driver_t));
+	memset(luadev->pool, 0, n * sizeof(luadevice_driver_t));
+	luadev->npool = (unsigned int)n;
+
+	for (i = 0; i < luadev->npool; i++) {
+		luadevice_driver_t *driver = &luadev->pool[i];
+		int ret;
+
+		if (lunatik_runtime(&driver->runtime, script, true) != 0)
+			luaL_error(L, "failed to create runtime for '%s'", script);
+
+		lunatik_run(driver->runtime, luadevice_doworker, ret, driver);
+		if (ret != 0)
+			luaL_error(L, "'%s' must return a driver table", script);
+	}
+	lua_pop(L, 2); /* script, n */
+}
+
+static int luadevice_update(lua_State *L)
+{
+	lunatik_object_t *object = lunatik_checkobject(L, 1);
+	luadevice_t *luadev = (luadevice_t *)object->private;
+
+	lunatik_checkupdate(L, luadev->main.runtime);
+	luadevice_setops(L, 2, &luadev->main);
+	lunatik_setregistry(L, 2, luadev); /* driver */
 	return 0;
 }
 
@@ -248,6 +715,8 @@ static const luaL_Reg luadevice_lib[] = {
 static const luaL_Reg luadevice_mt[] = {
 	{"__gc", lunatik_deleteobject},
 	{"stop", luadevice_stop},
+	{"update", luadevice_update},
+	{"wakeup", luadevice_wakeup},
 	{NULL, NULL}
 };
 
@@ -264,6 +733,7 @@ static int luadevice_new(lua_State *L)
 	luadevice_t *luadev;
 	struct device *device;
 	const char *name;
+	luadevice_op_t op;
 	int ret;
 
 	luaL_checktype(L, 1, LUA_TTABLE); /* driver */
@@ -275,9 +745,20 @@ static int luadevice_new(lua_State *L)
 	luadev = (luadevice_t *)object->private;
 
 	memset(luadev, 0, sizeof(luadevice_t));
+	luadev->main.driver = LUA_NOREF;
+	luadev->main.argument = LUA_NOREF;
+	for (op = 0; op < LUADEVICE_NOPS; op++)
+		luadev->main.ops[op] = LUA_NOREF;
+	init_waitqueue_head(&luadev->wait);
+	atomic_set(&luadev->next, 0);
+
+	lunatik_setruntime(L, device, &luadev->main);
+	lunatik_getobject(luadev->main.runtime);
+	luadevice_setdriver(L, 1, &luadev->main);
 
-	lunatik_setruntime(L, device, luadev);
-	lunatik_getobject(luadev->runtime);
+	if (lua_getfield(L, 1, "pool") == LUA_TTABLE)
+		luadevice_newpool(L, lua_gettop(L), luadev);
+	lua_pop(L, 1); /* pool */
 
 	if ((ret = alloc_chrdev_region(&luadev->devt, 0, 1, name) != 0))
 		luaL_error(L, "failed to allocate char device region (%d)", ret);
@@ -293,6 +774,7 @@ static int luadevice_new(lua_State *L)
 
 	device = device_create(luadevice_devclass, NULL, luadev->devt, luadev, name); /* calls devnode */
 	if (IS_ERR(device)) {
+		luadevice_unsetdriver(L, &luadev->main);
 		lunatik_unregisterobject(L, object);
 		luaL_error(L, "failed to create a new device (%d)", PTR_ERR(device));
 	}
@@ -317,7 +799,7 @@ static char *luadevice_devnode(struct device *dev, umode_t *mode)
 		goto out;
 
 	luadev = (luadevice_t *)dev_get_drvdata(dev);
-	L = lunatik_getstate(luadev->runtime);
+	L = lunatik_getstate(luadev->main.runtime);
 	if (!L)
 		goto out;
 
@@ -7,6 +7,8 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/kfifo.h>
+#include <linux/wait.h>
+#include <linux/kthread.h>
 
 #include <lua.h>
 #include <lualib.h>
@@ -14,27 +16,108 @@
 
 #include <lunatik.h>
 
-LUNATIK_PRIVATECHECKER(luafifo_check, struct kfifo *);
+/* record mode stores each push as a single message with a 2-byte length header */
+typedef struct luafifo_s {
+	union {
+		struct kfifo bytes;
+		struct kfifo_rec_ptr_2 records;
+	};
+	wait_queue_head_t wait;
+	struct kref kref; /* held by the object and by each sleeping consumer */
+	bool record;
+	bool closed;
+} luafifo_t;
+
+#define LUAFIFO_RECMAX	(U16_MAX)
+
+LUNATIK_PRIVATECHECKER(luafifo_check, luafifo_t *);
 
 static int luafifo_push(lua_State *L)
 {
-	struct kfifo *fifo = luafifo_check(L, 1);
+	luafifo_t *fifo = luafifo_check(L, 1);
 	size_t size;
 	const char *buf = luaL_checklstring(L, 2, &size);
-
-	luaL_argcheck(L, size <= kfifo_avail(fifo), 2, "not enough space");
-	kfifo_in(fifo, buf, size);
+	bool empty = kfifo_is_empty(&fifo->bytes);
+
+	if (fifo->record) {
+		luaL_argcheck(L, size <= LUAFIFO_RECMAX, 2, "record too long");
+		luaL_argcheck(L, size <= kfifo_avail(&fifo->records), 2, "not enough space");
+		kfifo_in(&fifo->records, buf, size);
+	}
+	else {
+		luaL_argcheck(L, size <= kfifo_avail(&fifo->bytes), 2, "not enough space");
+		kfifo_in(&fifo->bytes, buf, size);
+	}
+
+	/* consumers only sleep on an empty fifo, so we wake them once per burst */
+	if (empty)
+		wake_up_interruptible(&fifo->wait);
 	return 0;
 }
 
+static inline bool luafifo_shouldstop(void)
+{
+	return (current->flags & PF_KTHREAD) && kthread_should_stop();
+}
+
+#define luafifo_ready(fifo)	\
+	(!kfifo_is_empty(&(fifo)->bytes) || READ_ONCE((fifo)->closed) || luafifo_shouldstop())
+
+static void luafifo_free(struct kref *kref)
+{
+	luafifo_t *fifo = container_of(kref, luafifo_t, kref);
+
+	kfifo_free(&fifo->bytes);
+	kfree(fifo);
+}
+
+/*
+* called by the monitor, thus we release the object lock while sleeping;
+* the fifo might be closed meanwhile, so we hold a reference to it
+*/
+static long luafifo_wait(lunatik_object_t *object, luafifo_t *fifo, long timeout)
+{
+	kref_get(&fifo->kref);
+	lunatik_unlock(object);
+	timeout = wait_event_interruptible_timeout(fifo->wait, luafifo_ready(fifo), timeout);
+	lunatik_lock(object);
+	kref_put(&fifo->kref, luafifo_free);
+	return timeout;
+}
+
 static int luafifo_pop(lua_State *L)
 {
-	struct kfifo *fifo = luafifo_check(L, 1);
-	size_t size = luaL_checkinteger(L, 2);
+	lunatik_object_t *object = lunatik_checkobject(L, 1);
+	luafifo_t *fifo = luafifo_check(L, 1);
+	lua_Integer msecs = luaL_optinteger(L, 3, 0);
+	long timeout = msecs < 0 ? MAX_SCHEDULE_TIMEOUT : (long)msecs_to_jiffies((unsigned long)msecs);
+	size_t size;
 	luaL_Buffer B;
-	char *lbuf = luaL_buffinitsize(L, &B, size);
+	char *lbuf;
+
+	if (msecs != 0)
+		lunatik_checkruntime(L, true);
+
+	while (kfifo_is_empty(&fifo->bytes) && timeout > 0 && !luafifo_shouldstop()) {
+		timeout = luafifo_wait(object, fifo, timeout);
+		lunatik_argchecknull(L, object->private, 1); /* closed while sleeping */
+	}
+
+	if (fifo->record) {
+		bool empty = kfifo_is_empty(&fifo->records);
+		size_t len = empty ? 0 : kfifo_peek_len(&fifo->records);
+
+		size = luaL_optinteger(L, 2, len);
+		luaL_argcheck(L, size >= len, 2, "record is larger than size"); /* kfifo_out() would truncate it */
+		lbuf = luaL_buffinitsize(L, &B, size);
+		size = empty ? 0 : kfifo_out(&fifo->records, lbuf, size);
+	}
+	else {
+		size = luaL_checkinteger(L, 2);
+		lbuf = luaL_buffinitsize(L, &B, size);
+		size = kfifo_out(&fifo->bytes, lbuf, size);
+	}
 
-	size = kfifo_out(fifo, lbuf, size);
 	luaL_pushresultsize(&B, size);
 	lua_pushinteger(L, (lua_Integer)size);
 	return 2;
@@ -42,8 +125,11 @@ static int luafifo_pop(lua_State *L)
 
 static void luafifo_release(void *private)
 {
-	struct kfifo *fifo = (struct kfifo *)private;
-	kfifo_free(fifo);
+	luafifo_t *fifo = (luafifo_t *)private;
+
+	WRITE_ONCE(fifo->closed, true);
+	wake_up_interruptible_all(&fifo->wait);
+	kref_put(&fifo->kref, luafifo_free);
 }
 
 static int luafifo_new(lua_State *L);
@@ -68,17 +154,28 @@ static const lunatik_class_t luafifo_class = {
 	.methods = luafifo_mt,
 	.release = luafifo_release,
 	.sleep = false,
+	.pointer = true,
 };
 
 static int luafifo_new(lua_State *L)
 {
 	size_t size = luaL_checkinteger(L, 1);
-	lunatik_object_t *object = lunatik_newobject(L, &luafifo_class, sizeof(struct kfifo));
+	bool record = lua_toboolean(L, 2);
+	lunatik_object_t *object = lunatik_newobject(L, &luafifo_class, 0);
+	luafifo_t *fifo = (luafifo_t *)lunatik_checkalloc(L, sizeof(luafifo_t));
 	gfp_t gfp = lunatik_gfp(lunatik_toruntime(L));
 	int ret;
 
-	if ((ret = kfifo_alloc((struct kfifo *)object->private, size, gfp)) != 0)
+	if ((ret = kfifo_alloc(&fifo->bytes, size, gfp)) != 0) {
+		lunatik_free(fifo);
 		luaL_error(L, "failed to allocate kfifo (%d)", ret);
+	}
+
+	init_waitqueue_head(&fifo->wait);
+	kref_init(&fifo->kref);
+	fifo->record = record;
+	fifo->closed = false;
+	object->private = fifo;
 	return 1; /* object */
 }
 
@@ -0,0 +1,387 @@
+/*
+* SPDX-FileCopyrightText: (c) 2024 Ring Zero Desenvolvimento de Software LTDA
+* SPDX-License-Identifier: MIT OR GPL-2.0-only
+*/
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/jhash.h>
+#include <linux/hashtable.h>
+#include <linux/random.h>
+#include <linux/rculist.h>
+#include <linux/timer.h>
+#include <linux/jiffies.h>
+#include <linux/atomic.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include <lunatik.h>
+
+#include "luadata.h"
+
+#define LUAFLOW_KEYMAX		(64)
+#define LUAFLOW_VALUEMAX	(16)
+
+typedef struct luaflow_entry_s {
+	struct hlist_node hlist;
+	struct list_head list;
+	struct rcu_head rcu;
+	unsigned long expires;
+	bool referenced; /* touched since it was last scanned for eviction */
+	atomic64_t values[];
+	/* followed by key */
+} luaflow_entry_t;
+
+typedef struct luaflow_s {
+	struct list_head list; /* eviction order; least recently used first */
+	struct timer_list timer;
+	lunatik_object_t *object;
+	unsigned long timeout;
+	size_t capacity;
+	size_t count;
+	size_t keysize;
+	size_t nvalues;
+	u32 seed;
+	u32 mask;
+	struct hlist_head buckets[];
+} luaflow_t;
+
+#define luaflow_sizeof(nbuckets)	(sizeof(luaflow_t) + sizeof(struct hlist_head) * (nbuckets))
+#define luaflow_sizeofentry(flow)	(sizeof(luaflow_entry_t) + sizeof(atomic64_t) * (flow)->nvalues + (flow)->keysize)
+#define luaflow_key(flow, entry)	((u8 *)&(entry)->values[(flow)->nvalues])
+#define luaflow_bucket(flow, hash)	(&(flow)->buckets[(hash) & (flow)->mask])
+#define luaflow_hash(flow, key)		(jhash((key), (flow)->keysize, (flow)->seed))
+
+#define luaflow_foreach(flow, entry, next)	list_for_each_entry_safe((entry), (next), &(flow)->list, list)
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 16, 0))
+#define luaflow_fromtimer(t)	timer_container_of((luaflow_t *)NULL, (t), timer)
+#else
+#define luaflow_fromtimer(t)	from_timer((luaflow_t *)NULL, (t), timer)
+#endif
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0))
+#define luaflow_deltimer(t)	timer_delete_sync(t)
+#else
+#define luaflow_deltimer(t)	del_timer_sync(t)
+#endif
+
+static int luaflow_new(lua_State *L);
+
+LUNATIK_OBJECTCHECKER(luaflow_check, luaflow_t *);
+
+static inline void luaflow_touch(luaflow_t *flow, luaflow_entry_t *entry)
+{
+	if (!READ_ONCE(entry->referenced))
+		WRITE_ONCE(entry->referenced, true);
+	if (flow->timeout != 0)
+		WRITE_ONCE(entry->expires, jiffies + flow->timeout);
+}
+
+static luaflow_entry_t *luaflow_lookup(luaflow_t *flow, const u8 *key, u32 hash)
+{
+	luaflow_entry_t *entry;
+
+	hlist_for_each_entry_rcu(entry, luaflow_bucket(flow, hash), hlist)
+		if (memcmp(luaflow_key(flow, entry), key, flow->keysize) == 0)
+			return entry;
+	return NULL;
+}
+
+static inline void luaflow_remove(luaflow_t *flow, luaflow_entry_t *entry)
+{
+	hlist_del_rcu(&entry->hlist);
+	list_del(&entry->list);
+	flow->count--;
+	kfree_rcu(entry, rcu);
+}
+
+/*
+* second-chance (CLOCK) eviction: lookups only mark entries as referenced, thus they don't need the lock;
+* referenced entries are moved to the tail, approximating LRU. Must be called with flow object locked.
+*/
+static void luaflow_evict(luaflow_t *flow)
+{
+	luaflow_entry_t *entry = list_first_entry(&flow->list, luaflow_entry_t, list);
+	size_t n = flow->count;
+
+	while (n-- > 0 && READ_ONCE(entry->referenced)) {
+		WRITE_ONCE(entry->referenced, false);
+		list_move_tail(&entry->list, &flow->list);
+		entry = list_first_entry(&flow->list, luaflow_entry_t, list);
+	}
+	luaflow_remove(flow, entry);
+}
+
+/* must be called with flow object locked */
+static luaflow_entry_t *luaflow_insert(luaflow_t *flow, const u8 *key, u32 hash)
+{
+	luaflow_entry_t *entry;
+
+	if ((entry = luaflow_lookup(flow, key, hash)) != NULL)
+		return entry;
+
+	if ((entry = (luaflow_entry_t *)kzalloc(luaflow_sizeofentry(flow), GFP_ATOMIC)) == NULL)
+		return NULL;
+
+	if (flow->count >= flow->capacity)
+		luaflow_evict(flow);
+
+	memcpy(luaflow_key(flow, entry), key, flow->keysize);
+	luaflow_touch(flow, entry);
+	list_add_tail(&entry->list, &flow->list);
+	hlist_add_head_rcu(&entry->hlist, luaflow_bucket(flow, hash));
+	flow->count++;
+	return entry;
+}
+
+static void luaflow_expire(struct timer_list *timer)
+{
+	luaflow_t *flow = luaflow_fromtimer(timer);
+	lunatik_object_t *object = flow->object;
+	luaflow_entry_t *entry, *next;
+
+	lunatik_lock(object);
+	luaflow_foreach(flow, entry, next)
+		if (time_after(jiffies, READ_ONCE(entry->expires)))
+			luaflow_remove(flow, entry);
+	lunatik_unlock(object);
+
+	mod_timer(&flow->timer, jiffies + flow->timeout);
+}
+
+/* key is either a string or a data object followed by (offset, length) pairs */
+static void luaflow_checkkey(lua_State *L, luaflow_t *flow, int ix, u8 *key)
+{
+	int top = lua_gettop(L);
+	size_t keylen = 0;
+
+	if (lua_type(L, ix) == LUA_TSTRING) {
+		const char *str = lua_tolstring(L, ix, &keylen);
+		luaL_argcheck(L, keylen == flow->keysize, ix, "invalid key size");
+		memcpy(key, str, keylen);
+	}
+	else {
+		size_t size;
+		const char *ptr = luadata_checkbuffer(L, ix, &size, false);
+		int i;
+
+		for (i = ix + 1; i <= top && keylen < flow->keysize; i += 2) {
+			lua_Integer offset = luaL_checkinteger(L, i);
+			lua_Integer length = luaL_optinteger(L, i + 1, flow->keysize - keylen);
+			int bounds = offset >= 0 && length > 0 && offset + length <= size;
+
+			luaL_argcheck(L, bounds, i, "out of bounds");
+			luaL_argcheck(L, keylen + length <= flow->keysize, i + 1, "invalid key size");
+			memcpy(key + keylen, ptr + offset, length);
+			keylen += length;
+		}
+		luaL_argcheck(L, keylen == flow->keysize, ix, "invalid key size");
+	}
+}
+
+static inline int luaflow_checkslot(lua_State *L, luaflow_t *flow, int ix)
+{
+	lua_Integer slot = luaL_checkinteger(L, ix);
+	luaL_argcheck(L, slot >= 1 && slot <= flow->nvalues, ix, "invalid slot");
+	return (int)slot - 1;
+}
+
+static int luaflow_get(lua_State *L)
+{
+	luaflow_t *flow = luaflow_check(L, 1);
+	int slot = luaflow_checkslot(L, flow, 2);
+	luaflow_entry_t *entry;
+	u8 key[LUAFLOW_KEYMAX];
+	s64 value = 0;
+
+	luaflow_checkkey(L, flow, 3, key);
+
+	rcu_read_lock();
+	entry = luaflow_lookup(flow, key, luaflow_hash(flow, key));
+	if (entry != NULL) {
+		luaflow_touch(flow, entry);
+		value = atomic64_read(&entry->values[slot]);
+	}
+	rcu_read_unlock();
+
+	if (entry == NULL)
+		lua_pushnil(L);
+	else
+		lua_pushinteger(L, (lua_Integer)value);
+	return 1;
+}
+
+static luaflow_entry_t *luaflow_checkentry(lua_State *L, luaflow_t *flow, const u8 *key)
+{
+	lunatik_object_t *object = lunatik_checkobject(L, 1);
+	u32 hash = luaflow_hash(flow, key);
+	luaflow_entry_t *entry;
+
+	if ((entry = luaflow_lookup(flow, key, hash)) == NULL) {
+		lunatik_lock(object);
+		entry = luaflow_insert(flow, key, hash);
+		lunatik_unlock(object);
+	}
+
+	if (entry == NULL) {
+		rcu_read_unlock();
+		luaL_error(L, "not enough memory");
+	}
+
+	luaflow_touch(flow, entry);
+	return entry;
+}
+
+static int luaflow_set(lua_State *L)
+{
+	luaflow_t *flow = luaflow_check(L, 1);
+	int slot = luaflow_checkslot(L, flow, 2);
+	lua_Integer value = luaL_checkinteger(L, 3);
+	luaflow_entry_t *entry;
+	u8 key[LUAFLOW_KEYMAX];
+
+	luaflow_checkkey(L, flow, 4, key);
+
+	rcu_read_lock();
+	entry = luaflow_checkentry(L, flow, key);
+	atomic64_set(&entry->values[slot], (s64)value);
+	rcu_read_unlock();
+	return 0;
+}
+
+static int luaflow_add(lua_State *L)
+{
+	luaflow_t *flow = luaflow_check(L, 1);
+	int slot = luaflow_checkslot(L, flow, 2);
+	lua_Integer delta = luaL_checkinteger(L, 3);
+	luaflow_entry_t *entry;
+	u8 key[LUAFLOW_KEYMAX];
+	s64 value;
+
+	luaflow_checkkey(L, flow, 4, key);
+
+	rcu_read_lock();
+	entry = luaflow_checkentry(L, flow, key);
+	value = atomic64_add_return((s64)delta, &entry->values[slot]);
+	rcu_read_unlock();
+
+	lua_pushinteger(L, (lua_Integer)value);
+	return 1;
+}
+
+static int luaflow_delete(lua_State *L)
+{
+	lunatik_object_t *object = lunatik_checkobject(L, 1);
+	luaflow_t *flow = luaflow_check(L, 1);
+	luaflow_entry_t *entry;
+	u8 key[LUAFLOW_KEYMAX];
+
+	luaflow_checkkey(L, flow, 2, key);
+
+	lunatik_lock(object);
+	if ((entry = luaflow_lookup(flow, key, luaflow_hash(flow, key))) != NULL)
+		luaflow_remove(flow, entry);
+	lunatik_unlock(object);
+
+	lua_pushboolean(L, entry != NULL);
+	return 1;
+}
+
+static int luaflow_count(lua_State *L)
+{
+	luaflow_t *flow = luaflow_check(L, 1);
+	lua_pushinteger(L, (lua_Integer)READ_ONCE(flow->count));
+	return 1;
+}
+
+static void luaflow_release(void *private)
+{
+	luaflow_t *flow = (luaflow_t *)private;
+	luaflow_entry_t *entry, *next;
+
+	if (flow->timeout != 0)
+		luaflow_deltimer(&flow->timer);
+
+	luaflow_foreach(flow, entry, next)
+		luaflow_remove(flow, entry);
+}
+
+static const luaL_Reg luaflow_lib[] = {
+	{"new", luaflow_new},
+	{NULL, NULL}
+};
+
+static const luaL_Reg luaflow_mt[] = {
+	{"__gc", lunatik_deleteobject},
+	{"__len", luaflow_count},
+	{"get", luaflow_get},
+	{"set", luaflow_set},
+	{"add", luaflow_add},
+	{"delete", luaflow_delete},
+	{NULL, NULL}
+};
+
+static const lunatik_class_t luaflow_class = {
+	.name = "flow",
+	.methods = luaflow_mt,
+	.release = luaflow_release,
+	.sleep = false,
+};
+
+static int luaflow_new(lua_State *L)
+{
+	size_t capacity = (size_t)luaL_checkinteger(L, 1);
+	size_t keysize = (size_t)luaL_checkinteger(L, 2);
+	size_t nvalues = (size_t)luaL_optinteger(L, 3, 1);
+	lua_Integer timeout = luaL_optinteger(L, 4, 0);
+	size_t nbuckets;
+	lunatik_object_t *object;
+	luaflow_t *flow;
+
+	luaL_argcheck(L, capacity > 0, 1, "invalid capacity");
+	luaL_argcheck(L, keysize > 0 && keysize <= LUAFLOW_KEYMAX, 2, "invalid key size");
+	luaL_argcheck(L, nvalues > 0 && nvalues <= LUAFLOW_VALUEMAX, 3, "invalid number of values");
+	luaL_argcheck(L, timeout >= 0, 4, "invalid timeout");
+
+	nbuckets = roundup_pow_of_two(capacity);
+	object = lunatik_newobject(L, &luaflow_class, luaflow_sizeof(nbuckets));
+	flow = (luaflow_t *)object->private;
+
+	__hash_init(flow->buckets, nbuckets);
+	INIT_LIST_HEAD(&flow->list);
+	flow->object = object;
+	flow->capacity = capacity;
+	flow->keysize = keysize;
+	flow->nvalues = nvalues;
+	flow->count = 0;
+	flow->mask = nbuckets - 1;
+	flow->seed = get_random_u32();
+	flow->timeout = msecs_to_jiffies((unsigned int)timeout);
+
+	if (flow->timeout != 0) {
+		timer_setup(&flow->timer, luaflow_expire, 0);
+		mod_timer(&flow->timer, jiffies + flow->timeout);
+	}
+	return 1; /* object */
+}
+
+LUNATIK_NEWLIB(flow, luaflow_lib, &luaflow_class, NULL);
+
+static int __init luaflow_init(void)
+{
+	return 0;
+}
+
+static void __exit luaflow_exit(void)
+{
+}
+
+module_init(luaflow_init);
+module_exit(luaflow_exit);
+MODULE_LICENSE("Dual MIT/GPL");
+MODULE_AUTHOR("Lourival Vieira Neto <lourival.neto@ring-0.io>");
+
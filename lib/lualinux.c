@@ -208,6 +208,7 @@ static const lunatik_reg_t lualinux_errno[] = {
 	{"PIPE", EPIPE},	/* Broken pipe */
 	{"DOM", EDOM},		/* Math argument out of domain of func */
 	{"RANGE", ERANGE},	/* Math result not representable */
+	{"INPROGRESS", EINPROGRESS},	/* Operation now in progress */
 	{NULL, 0}
 };
 
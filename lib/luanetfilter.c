@@ -7,6 +7,21 @@
 #include <linux/module.h>
 #include <linux/version.h>
 #include <linux/netfilter.h>
+#include <linux/netfilter_ipv4.h>
+#include <linux/netfilter_ipv6.h>
+#include <linux/netdevice.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/wait.h>
+#include <net/net_namespace.h>
+#include <net/netns/generic.h>
+#include <net/sock.h>
+#if IS_ENABLED(CONFIG_NF_CONNTRACK)
+#include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_zones.h>
+#endif
 
 #include <lua.h>
 #include <lauxlib.h>
@@ -15,29 +30,249 @@
 #include "luanetfilter.h"
 #include "luadata.h"
 
+typedef struct luanetfilter_state_s {
+	struct sk_buff *skb;
+	const struct nf_hook_state *state;
+	lunatik_object_t *data; /* exposes skb */
+	void *priv; /* hook handling the packet */
+	u64 id; /* of that hook */
+	bool stolen;
+} luanetfilter_state_t;
+
 typedef struct luanetfilter_s {
 	lunatik_object_t *runtime;
 	lunatik_object_t *skb;
+	luanetfilter_state_t *state;
+	int hook; /* handler reference */
 	struct nf_hook_ops nfops;
+	struct list_head binds;
+	struct list_head node;
+	struct pernet_operations pernet;
+	u64 id; /* tells apart hooks reusing the same address */
+	bool all;
 } luanetfilter_t;
 
+/* a hook registered on a network namespace */
+typedef struct luanetfilter_bind_s {
+	struct list_head netnode;
+	struct list_head nfnode;
+	struct net *net;
+	luanetfilter_t *nf;
+} luanetfilter_bind_t;
+
+static DEFINE_MUTEX(luanetfilter_mutex);
+static LIST_HEAD(luanetfilter_all); /* hooks registered on all namespaces */
+static unsigned int luanetfilter_netid;
+static atomic64_t luanetfilter_lastid = ATOMIC64_INIT(0);
+
+#define luanetfilter_netbinds(net)	((struct list_head *)net_generic((net), luanetfilter_netid))
+
+#define LUANETFILTER_STATE	"netfilter.state"
+
 static void luanetfilter_release(void *private);
 
-static int luanetfilter_hook_cb(lua_State *L, luanetfilter_t *luanf, struct sk_buff *skb)
+static inline luanetfilter_state_t *luanetfilter_checkstate(lua_State *L, int ix)
 {
-	int ret = -1;
-	if (lunatik_getregistry(L, luanf) != LUA_TTABLE) {
-		pr_err("lunatik hook: could not find ops table\n");
-		goto err;
+	luanetfilter_state_t *state = (luanetfilter_state_t *)luaL_checkudata(L, ix, LUANETFILTER_STATE);
+	luaL_argcheck(L, state->skb != NULL, ix, "hook state is only available during the hook call");
+	return state;
+}
+
+static inline const struct nf_hook_state *luanetfilter_checkhookstate(lua_State *L)
+{
+	luanetfilter_state_t *state = luanetfilter_checkstate(L, 1);
+	luaL_argcheck(L, state->state != NULL, 1, "hook state isn't available on this kernel");
+	return state->state;
+}
+
+static int luanetfilter_hooknum(lua_State *L)
+{
+	lua_pushinteger(L, (lua_Integer)luanetfilter_checkhookstate(L)->hook);
+	return 1;
+}
+
+static int luanetfilter_pf(lua_State *L)
+{
+	lua_pushinteger(L, (lua_Integer)luanetfilter_checkhookstate(L)->pf);
+	return 1;
+}
+
+static inline int luanetfilter_pushdev(lua_State *L, const struct net_device *dev)
+{
+	if (dev == NULL) {
+		lua_pushnil(L);
+		return 1;
 	}
+	lua_pushinteger(L, (lua_Integer)dev->ifindex);
+	lua_pushstring(L, dev->name);
+	return 2;
+}
+
+static int luanetfilter_indev(lua_State *L)
+{
+	return luanetfilter_pushdev(L, luanetfilter_checkhookstate(L)->in);
+}
+
+static int luanetfilter_outdev(lua_State *L)
+{
+	return luanetfilter_pushdev(L, luanetfilter_checkhookstate(L)->out);
+}
+
+static int luanetfilter_netns(lua_State *L)
+{
+	const struct nf_hook_state *state = luanetfilter_checkhookstate(L);
+	lua_pushinteger(L, (lua_Integer)state->net->ns.inum);
+	return 1;
+}
+
+static int luanetfilter_mark(lua_State *L)
+{
+	struct sk_buff *skb = luanetfilter_checkstate(L, 1)->skb;
+
+	lua_pushinteger(L, (lua_Integer)skb->mark);
+	if (!lua_isnoneornil(L, 2))
+		skb->mark = (u32)luaL_checkinteger(L, 2);
+	return 1; /* previous mark */
+}
+
+#if IS_ENABLED(CONFIG_NF_CONNTRACK)
+static inline struct nf_conn *luanetfilter_getct(lua_State *L, enum ip_conntrack_info *ctinfo)
+{
+	struct sk_buff *skb = luanetfilter_checkstate(L, 1)->skb;
+	return nf_ct_get(skb, ctinfo);
+}
+
+static int luanetfilter_ct(lua_State *L)
+{
+	enum ip_conntrack_info ctinfo;
+	struct nf_conn *ct = luanetfilter_getct(L, &ctinfo);
+
+	if (ct == NULL) {
+		lua_pushnil(L);
+		return 1;
+	}
+	lua_pushinteger(L, (lua_Integer)ctinfo);
+	lua_pushinteger(L, (lua_Integer)READ_ONCE(ct->status));
+	return 2;
+}
+
+static int luanetfilter_ctmark(lua_State *L)
+{
+	enum ip_conntrack_info ctinfo;
+	struct nf_conn *ct = luanetfilter_getct(L, &ctinfo);
+
+	luaL_argcheck(L, ct != NULL, 1, "untracked packet");
+#if IS_ENABLED(CONFIG_NF_CONNTRACK_MARK)
+	lua_pushinteger(L, (lua_Integer)READ_ONCE(ct->mark));
+	if (!lua_isnoneornil(L, 2)) {
+		u32 mark = (u32)luaL_checkinteger(L, 2);
+		if (READ_ONCE(ct->mark) != mark) {
+			WRITE_ONCE(ct->mark, mark);
+			nf_conntrack_event_cache(IPCT_MARK, ct);
+		}
+	}
+	return 1; /* previous mark */
+#else
+	return luaL_error(L, "conntrack mark isn't supported");
+#endif
+}
+
+static int luanetfilter_ctzone(lua_State *L)
+{
+	enum ip_conntrack_info ctinfo;
+	struct nf_conn *ct = luanetfilter_getct(L, &ctinfo);
+
+	luaL_argcheck(L, ct != NULL, 1, "untracked packet");
+	lua_pushinteger(L, (lua_Integer)nf_ct_zone(ct)->id);
+	return 1;
+}
+
+static inline void luanetfilter_pushaddr(lua_State *L, u16 l3num, const union nf_inet_addr *addr)
+{
+	if (l3num == NFPROTO_IPV4)
+		lua_pushinteger(L, (lua_Integer)ntohl(addr->ip));
+	else
+		lua_pushlstring(L, (const char *)addr->all, sizeof(addr->all));
+}
+
+static int luanetfilter_cttuple(lua_State *L)
+{
+	enum ip_conntrack_info ctinfo;
+	struct nf_conn *ct = luanetfilter_getct(L, &ctinfo);
+	int dir = lua_toboolean(L, 2) ? IP_CT_DIR_REPLY : IP_CT_DIR_ORIGINAL;
+	const struct nf_conntrack_tuple *tuple;
+	u16 l3num;
+
+	luaL_argcheck(L, ct != NULL, 1, "untracked packet");
+	tuple = &ct->tuplehash[dir].tuple;
+	l3num = tuple->src.l3num;
 
-	if (lua_getfield(L, -1, "hook") != LUA_TFUNCTION) {
-		pr_err("luanetfilter hook: operation not defined");
+	lua_pushinteger(L, (lua_Integer)tuple->dst.protonum);
+	luanetfilter_pushaddr(L, l3num, &tuple->src.u3);
+	lua_pushinteger(L, (lua_Integer)ntohs(tuple->src.u.all));
+	luanetfilter_pushaddr(L, l3num, &tuple->dst.u3);
+	lua_pushinteger(L, (lua_Integer)ntohs(tuple->dst.u.all));
+	return 5;
+}
+#endif
+
+static const luaL_Reg luanetfilter_state_mt[] = {
+	{"hooknum", luanetfilter_hooknum},
+	{"pf", luanetfilter_pf},
+	{"indev", luanetfilter_indev},
+	{"outdev", luanetfilter_outdev},
+	{"netns", luanetfilter_netns},
+	{"mark", luanetfilter_mark},
+#if IS_ENABLED(CONFIG_NF_CONNTRACK)
+	{"ct", luanetfilter_ct},
+	{"ctmark", luanetfilter_ctmark},
+	{"ctzone", luanetfilter_ctzone},
+	{"cttuple", luanetfilter_cttuple},
+#endif
+	{NULL, NULL}
+};
+
+static luanetfilter_state_t *luanetfilter_pushstate(lua_State *L)
+{
+	luanetfilter_state_t *state = (luanetfilter_state_t *)lua_newuserdatauv(L, sizeof(luanetfilter_state_t), 0);
+	state->skb = NULL;
+	state->state = NULL;
+	state->data = NULL;
+	state->priv = NULL;
+	state->id = 0;
+	state->stolen = false;
+
+	if (luaL_newmetatable(L, LUANETFILTER_STATE)) {
+		luaL_setfuncs(L, luanetfilter_state_mt, 0);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+	}
+	lua_setmetatable(L, -2);
+	return state;
+}
+
+static void luanetfilter_newstate(lua_State *L, luanetfilter_t *nf)
+{
+	nf->state = luanetfilter_pushstate(L);
+	nf->state->data = nf->skb;
+	nf->state->priv = nf;
+	nf->state->id = nf->id;
+	lunatik_setregistry(L, -1, nf->state);
+	lua_pop(L, 1); /* state */
+}
+
+static int luanetfilter_hook_cb(lua_State *L, luanetfilter_t *luanf, struct sk_buff *skb, const struct nf_hook_state *state)
+{
+	int ret = -1;
+	int type = lunatik_getref(L, luanf->hook);
+	if (type != LUA_TFUNCTION && type != LUA_TTABLE) {
+		pr_err("luanetfilter hook: operation not defined\n");
 		goto err;
 	}
+	int hook = lua_gettop(L);
 
 	if (lunatik_getregistry(L, luanf->skb) != LUA_TUSERDATA) {
-		pr_err("luanetfilter hook: could not find skb");
+		pr_err("luanetfilter hook: could not find skb\n");
 		goto err;
 	}
 	lunatik_object_t *data = (lunatik_object_t *)lunatik_toobject(L, -1);
@@ -45,18 +280,47 @@ static int luanetfilter_hook_cb(lua_State *L, luanetfilter_t *luanf, struct sk_b
 		pr_err("could not get skb\n");
 		return -1;
 	}
-	luadata_reset(data, skb->data, skb_headlen(skb), LUADATA_OPT_NONE);
+	luadata_resetskb(data, skb, LUADATA_OPT_NONE);
 
-	if (lua_pcall(L, 1, 1, 0) != LUA_OK) {
-		pr_err("luanetfilter hook: pcall error %s\n", lua_tostring(L, -1));
+	if (lunatik_getregistry(L, luanf->state) != LUA_TUSERDATA) {
+		pr_err("luanetfilter hook: could not find state\n");
 		goto err;
 	}
-	ret = lua_tointeger(L, -1);
+	luanf->state->skb = skb;
+	luanf->state->state = state;
+	luanf->state->stolen = false;
+
+	/* a chain of handlers runs until the first verdict other than ACCEPT */
+	lua_Integer i, n = type == LUA_TTABLE ? (lua_Integer)lua_rawlen(L, hook) : 1;
+	for (i = 1; i <= n; i++) {
+		if (type == LUA_TTABLE)
+			lua_rawgeti(L, hook, i);
+		else
+			lua_pushvalue(L, hook);
+		lua_pushvalue(L, hook + 1); /* skb */
+		lua_pushvalue(L, hook + 2); /* state */
+
+		if (lua_pcall(L, 2, 1, 0) != LUA_OK) {
+			pr_err("luanetfilter hook: pcall error %s\n", lua_tostring(L, -1));
+			ret = NF_ACCEPT;
+		}
+		else
+			ret = lua_tointeger(L, -1);
+		lua_pop(L, 1); /* verdict or error */
+
+		if (ret != NF_ACCEPT || luanf->state->stolen)
+			break;
+	}
+
+	if (luanf->state->stolen) /* skb was queued */
+		ret = NF_STOLEN;
+	luanf->state->skb = NULL;
+	luanf->state->state = NULL;
 err:
 	return ret;
 }
 
-static inline unsigned int luanetfilter_docall(luanetfilter_t *luanf, struct sk_buff *skb)
+static inline unsigned int luanetfilter_docall(luanetfilter_t *luanf, struct sk_buff *skb, const struct nf_hook_state *state)
 {
 	int ret;
 	if (!luanf || !luanf->runtime) {
@@ -64,7 +328,7 @@ static inline unsigned int luanetfilter_docall(luanetfilter_t *luanf, struct sk_
 		return NF_ACCEPT;
 	}
 
-	lunatik_run(luanf->runtime, luanetfilter_hook_cb, ret, luanf, skb);
+	lunatik_run(luanf->runtime, luanetfilter_hook_cb, ret, luanf, skb, state);
 	return (ret < 0 || ret > NF_MAX_VERDICT) ? NF_ACCEPT : ret;
 }
 
@@ -72,24 +336,392 @@ static inline unsigned int luanetfilter_docall(luanetfilter_t *luanf, struct sk_
 static unsigned int luanetfilter_hook(void *priv, struct sk_buff *skb, const struct nf_hook_state *state)
 {
 	luanetfilter_t *luanf = (luanetfilter_t *)priv;
-	return luanetfilter_docall(luanf, skb);
+	return luanetfilter_docall(luanf, skb, state);
 }
 #elif (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0))
 static unsigned int luanetfilter_hook(const struct nf_hook_ops *ops, struct sk_buff *skb, const struct nf_hook_state *state)
 {
 	luanetfilter_t *luanf = (luanetfilter_t *)ops->priv;
-	return luanetfilter_docall(luanf, skb);
+	return luanetfilter_docall(luanf, skb, state);
 }
 #else
 static unsigned int luanetfilter_hook(const struct nf_hook_ops *ops, struct sk_buff *skb, const struct net_device *in, const struct net_device *out, int (*okfn)(struct sk_buff *))
 {
 	luanetfilter_t *luanf = (luanetfilter_t *)ops->priv;
-	return luanetfilter_docall(luanf, skb);
+	return luanetfilter_docall(luanf, skb, NULL);
+}
+#endif
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0))
+typedef struct luanetfilter_entry_s {
+	struct list_head list;
+	struct sk_buff *skb;
+	struct nf_hook_state state;
+	void *priv;
+	u64 id;
+	u32 mark;
+	union {
+		struct {
+			__be32 saddr;
+			__be32 daddr;
+			u8 tos;
+		} ip;
+		struct {
+			struct in6_addr saddr;
+			struct in6_addr daddr;
+		} ip6;
+	} route; /* of locally generated packets, as saved by nf_queue */
+} luanetfilter_entry_t;
+
+typedef struct luanetfilter_queue_s {
+	struct list_head entries;
+	wait_queue_head_t wait;
+	size_t size;
+	size_t count;
+	unsigned int overflow;
+} luanetfilter_queue_t;
+
+static inline void luanetfilter_getrefs(struct nf_hook_state *state)
+{
+	if (state->in)
+		dev_hold(state->in);
+	if (state->out)
+		dev_hold(state->out);
+	if (state->sk)
+		sock_hold(state->sk);
+	get_net(state->net);
+}
+
+static inline void luanetfilter_putrefs(struct nf_hook_state *state)
+{
+	if (state->in)
+		dev_put(state->in);
+	if (state->out)
+		dev_put(state->out);
+	if (state->sk)
+		sock_put(state->sk);
+	put_net(state->net);
 }
+
+/* as nf_hook_entry_head(), which isn't exported */
+static const struct nf_hook_entries *luanetfilter_hooks(const struct nf_hook_state *state)
+{
+	struct net *net = state->net;
+
+	switch (state->pf) {
+	case NFPROTO_IPV4:
+		return rcu_dereference(net->nf.hooks_ipv4[state->hook]);
+	case NFPROTO_IPV6:
+		return rcu_dereference(net->nf.hooks_ipv6[state->hook]);
+#ifdef CONFIG_NETFILTER_FAMILY_ARP
+	case NFPROTO_ARP:
+		return rcu_dereference(net->nf.hooks_arp[state->hook]);
+#endif
+#ifdef CONFIG_NETFILTER_FAMILY_BRIDGE
+	case NFPROTO_BRIDGE:
+		return rcu_dereference(net->nf.hooks_bridge[state->hook]);
+#endif
+	}
+	return NULL;
+}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0))
+#define luanetfilter_reroute4(state, skb)	ip_route_me_harder((state)->net, (state)->sk, (skb), RTN_UNSPEC)
+#define luanetfilter_reroute6(state, skb)	nf_ip6_route_me_harder((state)->net, (state)->sk, (skb))
+#else
+#define luanetfilter_reroute4(state, skb)	ip_route_me_harder((state)->net, (skb), RTN_UNSPEC)
+#define luanetfilter_reroute6(state, skb)	ip6_route_me_harder((state)->net, (skb))
 #endif
 
+/* as nf_ip_saveroute() and nf_ip6_saveroute(), which aren't exported */
+static void luanetfilter_saveroute(luanetfilter_entry_t *entry)
+{
+	struct sk_buff *skb = entry->skb;
+
+	if (entry->state.hook != NF_INET_LOCAL_OUT)
+		return;
+
+	entry->mark = skb->mark;
+	if (entry->state.pf == NFPROTO_IPV4) {
+		const struct iphdr *iph = ip_hdr(skb);
+		entry->route.ip.saddr = iph->saddr;
+		entry->route.ip.daddr = iph->daddr;
+		entry->route.ip.tos = iph->tos;
+	}
+	else if (entry->state.pf == NFPROTO_IPV6) {
+		const struct ipv6hdr *iph = ipv6_hdr(skb);
+		entry->route.ip6.saddr = iph->saddr;
+		entry->route.ip6.daddr = iph->daddr;
+	}
+}
+
+/* as nf_reroute(), which isn't exported; reroutes packets whose route keys were changed by the handler */
+static int luanetfilter_reroute(luanetfilter_entry_t *entry)
+{
+	struct nf_hook_state *state = &entry->state;
+	struct sk_buff *skb = entry->skb;
+
+	if (state->hook != NF_INET_LOCAL_OUT)
+		return 0;
+
+	if (state->pf == NFPROTO_IPV4) {
+		const struct iphdr *iph = ip_hdr(skb);
+		if (iph->saddr != entry->route.ip.saddr || iph->daddr != entry->route.ip.daddr ||
+			iph->tos != entry->route.ip.tos || skb->mark != entry->mark)
+			return luanetfilter_reroute4(state, skb);
+	}
+#if IS_ENABLED(CONFIG_IPV6)
+	else if (state->pf == NFPROTO_IPV6) {
+		const struct ipv6hdr *iph = ipv6_hdr(skb);
+		if (!ipv6_addr_equal(&iph->saddr, &entry->route.ip6.saddr) ||
+			!ipv6_addr_equal(&iph->daddr, &entry->route.ip6.daddr) || skb->mark != entry->mark)
+			return luanetfilter_reroute6(state, skb);
+	}
+#endif
+	return 0;
+}
+
+/* registered hooks are alive, thus we can check the id of a new hook reusing the address of a released one */
+static inline bool luanetfilter_isstealer(const struct nf_hook_entry *hook, luanetfilter_entry_t *entry)
+{
+	return hook->hook == luanetfilter_hook && hook->priv == entry->priv &&
+		((luanetfilter_t *)hook->priv)->id == entry->id;
+}
+
+/* resumes the packet traversal past the hook that stole it, as nf_reinject() does */
+static void luanetfilter_resume(luanetfilter_entry_t *entry)
+{
+	struct nf_hook_state *state = &entry->state;
+	const struct nf_hook_entries *hooks;
+	unsigned int i = 0;
+
+	rcu_read_lock();
+	local_bh_disable();
+	if ((hooks = luanetfilter_hooks(state)) != NULL)
+		for (; i < hooks->num_hook_entries; i++)
+			if (luanetfilter_isstealer(&hooks->hooks[i], entry))
+				break;
+
+	if (hooks == NULL || i == hooks->num_hook_entries) /* hook was unregistered */
+		kfree_skb(entry->skb);
+	else if (luanetfilter_reroute(entry) < 0)
+		kfree_skb(entry->skb);
+	else if (nf_hook_slow(entry->skb, state, hooks, i + 1) == 1)
+		state->okfn(state->net, state->sk, entry->skb);
+	local_bh_enable();
+	rcu_read_unlock();
+}
+
+static void luanetfilter_reinject(luanetfilter_entry_t *entry, unsigned int verdict)
+{
+	struct nf_hook_state *state = &entry->state;
+
+	if (verdict == NF_ACCEPT)
+		luanetfilter_resume(entry);
+	else if (verdict != NF_STOLEN) /* stolen entries were queued again */
+		kfree_skb(entry->skb);
+
+	luanetfilter_putrefs(state);
+	kfree(entry);
+}
+
+static int luanetfilter_push(lua_State *L)
+{
+	lunatik_object_t *object = lunatik_checkobject(L, 1);
+	luanetfilter_queue_t *queue = (luanetfilter_queue_t *)object->private;
+	luanetfilter_state_t *state = luanetfilter_checkstate(L, 2);
+	luanetfilter_entry_t *entry;
+	unsigned int verdict = queue->overflow;
+
+	luaL_argcheck(L, state->state != NULL && state->state->okfn != NULL && state->priv != NULL && !state->stolen,
+		2, "packet cannot be queued");
+	if ((entry = kmalloc(sizeof(luanetfilter_entry_t), GFP_ATOMIC)) == NULL)
+		goto out;
+
+	lunatik_lock(object);
+	if (queue->count < queue->size) {
+		skb_dst_force(state->skb);
+		entry->skb = state->skb;
+		entry->state = *state->state;
+		entry->priv = state->priv;
+		entry->id = state->id;
+		luanetfilter_saveroute(entry);
+		luanetfilter_getrefs(&entry->state);
+		list_add_tail(&entry->list, &queue->entries);
+		queue->count++;
+		verdict = NF_STOLEN;
+	}
+	lunatik_unlock(object);
+
+	if (verdict == NF_STOLEN) { /* the packet might be dispatched (and freed) at any time from now on */
+		state->skb = NULL;
+		state->state = NULL;
+		state->stolen = true;
+		luadata_clear(state->data);
+		wake_up_interruptible(&queue->wait);
+	}
+	else
+		kfree(entry);
+out:
+	lua_pushinteger(L, (lua_Integer)verdict);
+	return 1;
+}
+
+static int luanetfilter_dispatch(lua_State *L)
+{
+	lunatik_object_t *object = lunatik_checkobject(L, 1);
+	luanetfilter_queue_t *queue = (luanetfilter_queue_t *)object->private;
+	lua_Integer n = luaL_optinteger(L, 3, queue->size);
+	lua_Integer timeout = luaL_optinteger(L, 4, 0);
+	luanetfilter_entry_t *entry, *next;
+	luanetfilter_state_t *state;
+	lunatik_object_t *data;
+	LIST_HEAD(entries);
+	lua_Integer count = 0;
+	int ix;
+
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+	luaL_argcheck(L, n > 0, 3, "invalid batch size");
+	luaL_argcheck(L, timeout >= 0, 4, "invalid timeout");
+
+	/* reinjected packets might hit hooks running on (non-sleepable) runtimes, thus we can't hold one */
+	lunatik_checkruntime(L, true);
+
+	if (timeout > 0) {
+		if (wait_event_interruptible_timeout(queue->wait, READ_ONCE(queue->count) > 0,
+			msecs_to_jiffies(timeout)) < 0) {
+			lua_pushinteger(L, 0);
+			return 1;
+		}
+	}
+
+	lunatik_requiref(L, data);
+	data = lunatik_checknull(L, luadata_new(NULL, 0, false, LUADATA_OPT_NONE));
+	lunatik_cloneobject(L, data);
+	ix = lua_gettop(L);
+	state = luanetfilter_pushstate(L);
+	state->data = data;
+
+	lunatik_lock(object);
+	while (count < n && !list_empty(&queue->entries)) {
+		list_move_tail(queue->entries.next, &entries);
+		count++;
+	}
+	queue->count -= count;
+	lunatik_unlock(object);
+
+	list_for_each_entry_safe(entry, next, &entries, list) {
+		unsigned int verdict = NF_ACCEPT;
+
+		lua_pushvalue(L, 2); /* handler */
+		lua_pushvalue(L, ix); /* skb */
+		lua_pushvalue(L, ix + 1); /* state */
+		luadata_resetskb(data, entry->skb, LUADATA_OPT_NONE);
+		state->skb = entry->skb;
+		state->state = &entry->state;
+		state->priv = entry->priv;
+		state->id = entry->id;
+		state->stolen = false;
+
+		if (lua_pcall(L, 2, 1, 0) != LUA_OK)
+			pr_err("luanetfilter queue: pcall error %s\n", lua_tostring(L, -1));
+		else if (lua_tointeger(L, -1) != NF_ACCEPT)
+			verdict = NF_DROP;
+		lua_pop(L, 1); /* verdict or error */
+
+		if (state->stolen)
+			verdict = NF_STOLEN;
+		state->skb = NULL;
+		state->state = NULL;
+
+		list_del(&entry->list);
+		luanetfilter_reinject(entry, verdict);
+	}
+	luadata_clear(data);
+
+	lua_pushinteger(L, count);
+	return 1;
+}
+
+static int luanetfilter_len(lua_State *L)
+{
+	lunatik_object_t *object = lunatik_checkobject(L, 1);
+	luanetfilter_queue_t *queue = (luanetfilter_queue_t *)object->private;
+	lua_pushinteger(L, (lua_Integer)READ_ONCE(queue->count));
+	return 1;
+}
+
+static void luanetfilter_queue_release(void *private)
+{
+	luanetfilter_queue_t *queue = (luanetfilter_queue_t *)private;
+	luanetfilter_entry_t *entry, *next;
+
+	list_for_each_entry_safe(entry, next, &queue->entries, list) {
+		list_del(&entry->list);
+		luanetfilter_reinject(entry, NF_DROP);
+	}
+}
+
+static const luaL_Reg luanetfilter_queue_mt[] = {
+	{"__gc", lunatik_deleteobject},
+	{"__len", luanetfilter_len},
+	{"push", luanetfilter_push},
+	{"dispatch", luanetfilter_dispatch},
+	{NULL, NULL}
+};
+
+static const lunatik_class_t luanetfilter_queue_class = {
+	.name = "netfilter.queue",
+	.methods = luanetfilter_queue_mt,
+	.release = luanetfilter_queue_release,
+	.sleep = false,
+};
+
+static int luanetfilter_queue(lua_State *L)
+{
+	lua_Integer size = luaL_checkinteger(L, 1);
+	lua_Integer overflow = luaL_optinteger(L, 2, NF_DROP);
+	lunatik_object_t *object;
+	luanetfilter_queue_t *queue;
+
+	luaL_argcheck(L, size > 0, 1, "invalid size");
+	luaL_argcheck(L, overflow == NF_ACCEPT || overflow == NF_DROP, 2, "invalid overflow verdict");
+
+	object = lunatik_newobject(L, &luanetfilter_queue_class, sizeof(luanetfilter_queue_t));
+	queue = (luanetfilter_queue_t *)object->private;
+
+	INIT_LIST_HEAD(&queue->entries);
+	init_waitqueue_head(&queue->wait);
+	queue->size = (size_t)size;
+	queue->count = 0;
+	queue->overflow = (unsigned int)overflow;
+	return 1; /* object */
+}
+#endif
+
+static inline void luanetfilter_sethook(lua_State *L, int ix, luanetfilter_t *nf)
+{
+	int type = lua_getfield(L, ix, "hook");
+	luaL_argcheck(L, type == LUA_TFUNCTION || type == LUA_TTABLE, ix, "'hook' must be a function or a chain");
+	lunatik_setref(L, -1, &nf->hook);
+	lua_pop(L, 1); /* hook */
+}
+
+LUNATIK_OBJECTCHECKER(luanetfilter_check, luanetfilter_t *);
+
+static int luanetfilter_update(lua_State *L)
+{
+	luanetfilter_t *nf = luanetfilter_check(L, 1);
+
+	lunatik_checkupdate(L, nf->runtime);
+	luanetfilter_sethook(L, 2, nf);
+	lunatik_setregistry(L, 2, nf); /* ops */
+	return 0;
+}
+
 static const luaL_Reg luanetfilter_mt[] = {
 	{"__gc", lunatik_deleteobject},
+	{"update", luanetfilter_update},
 	{NULL, NULL}
 };
 
@@ -100,13 +732,124 @@ static const lunatik_class_t luanetfilter_class = {
 	.sleep = false,
 };
 
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0))
+#define luanetfilter_registerhook(net, ops)	nf_register_net_hook((net), (ops))
+#define luanetfilter_unregisterhook(net, ops)	nf_unregister_net_hook((net), (ops))
+#else /* hooks aren't bound to a namespace; thus, only init_net is tracked */
+#define luanetfilter_registerhook(net, ops)	nf_register_hook(ops)
+#define luanetfilter_unregisterhook(net, ops)	nf_unregister_hook(ops)
+#endif
+
+static int luanetfilter_bind(struct net *net, luanetfilter_t *nf)
+{
+	luanetfilter_bind_t *bind;
+	int ret;
+
+	if ((bind = kmalloc(sizeof(luanetfilter_bind_t), GFP_KERNEL)) == NULL)
+		return -ENOMEM;
+
+	if ((ret = luanetfilter_registerhook(net, &nf->nfops)) != 0) {
+		kfree(bind);
+		return ret;
+	}
+	bind->net = net;
+	bind->nf = nf;
+	list_add_tail(&bind->netnode, luanetfilter_netbinds(net));
+	list_add_tail(&bind->nfnode, &nf->binds);
+	return 0;
+}
+
+static void luanetfilter_unbind(luanetfilter_bind_t *bind)
+{
+	luanetfilter_unregisterhook(bind->net, &bind->nf->nfops);
+	list_del(&bind->netnode);
+	list_del(&bind->nfnode);
+	kfree(bind);
+}
+
+static inline bool luanetfilter_isbound(struct net *net, luanetfilter_t *nf)
+{
+	luanetfilter_bind_t *bind;
+	list_for_each_entry(bind, luanetfilter_netbinds(net), netnode)
+		if (bind->nf == nf)
+			return true;
+	return false;
+}
+
+/* called for each namespace, including new ones, while any hook is registered on all namespaces */
+static int luanetfilter_net_sync(struct net *net)
+{
+	luanetfilter_t *nf;
+
+	mutex_lock(&luanetfilter_mutex);
+	list_for_each_entry(nf, &luanetfilter_all, node) {
+		int ret;
+		if (!luanetfilter_isbound(net, nf) && (ret = luanetfilter_bind(net, nf)) != 0)
+			pr_warn("failed to register hook on netns %u: %d\n", net->ns.inum, ret);
+	}
+	mutex_unlock(&luanetfilter_mutex);
+	return 0;
+}
+
+static int __net_init luanetfilter_net_init(struct net *net)
+{
+	INIT_LIST_HEAD(luanetfilter_netbinds(net));
+	return 0;
+}
+
+static void __net_exit luanetfilter_net_exit(struct net *net)
+{
+	luanetfilter_bind_t *bind, *next;
+
+	mutex_lock(&luanetfilter_mutex);
+	list_for_each_entry_safe(bind, next, luanetfilter_netbinds(net), netnode)
+		luanetfilter_unbind(bind);
+	mutex_unlock(&luanetfilter_mutex);
+}
+
+static struct pernet_operations luanetfilter_net_ops = {
+	.init = luanetfilter_net_init,
+	.exit = luanetfilter_net_exit,
+	.id = &luanetfilter_netid,
+	.size = sizeof(struct list_head),
+};
+
+static void luanetfilter_unbindall(luanetfilter_t *nf)
+{
+	luanetfilter_bind_t *bind, *next;
+
+	if (nf->all)
+		unregister_pernet_subsys(&nf->pernet);
+
+	mutex_lock(&luanetfilter_mutex);
+	if (!list_empty(&nf->node))
+		list_del_init(&nf->node);
+	list_for_each_entry_safe(bind, next, &nf->binds, nfnode)
+		luanetfilter_unbind(bind);
+	mutex_unlock(&luanetfilter_mutex);
+}
+
 static int luanetfilter_register(lua_State *L)
 {
 	luaL_checktype(L, 1, LUA_TTABLE);
 	lunatik_object_t *object = lunatik_newobject(L, &luanetfilter_class , sizeof(luanetfilter_t));
 	luanetfilter_t *nf = (luanetfilter_t *)object->private;
+	struct net *net = NULL;
+	bool all;
+	int ret;
+
+	nf->id = (u64)atomic64_inc_return(&luanetfilter_lastid);
 	luanetfilter_newbuffer(L, 1, nf, skb);
+	luanetfilter_newstate(L, nf);
 	nf->runtime = NULL;
+	nf->hook = LUA_NOREF;
+	nf->all = false;
+	INIT_LIST_HEAD(&nf->binds);
+	INIT_LIST_HEAD(&nf->node);
+
+	/* hooks might run as soon as they are registered; from now on, errors are unwound by release */
+	lunatik_setruntime(L, netfilter, nf);
+	lunatik_getobject(nf->runtime);
 
 	struct nf_hook_ops *nfops = &nf->nfops;
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 14, 0))
@@ -119,21 +862,48 @@ static int luanetfilter_register(lua_State *L)
 	lunatik_setinteger(L, 1, nfops, hooknum);
 	lunatik_setinteger(L, 1, nfops, priority);
 
-#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0))
-	if (nf_register_net_hook(&init_net, nfops) != 0)
-		luaL_error(L, "failed to register netfilter hook");
-#else
-	if (nf_register_hook(nfops) != 0)
-		luaL_error(L, "failed to register netfilter hook");
+	luanetfilter_sethook(L, 1, nf);
+
+	lua_getfield(L, 1, "netns");
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(4, 13, 0))
+	luaL_argcheck(L, lua_isnil(L, -1), 1, "netns requires Linux 4.13 or later");
 #endif
-	lunatik_setruntime(L, netfilter, nf);
-	lunatik_getobject(nf->runtime);
+	if ((all = lua_type(L, -1) == LUA_TSTRING)) /* "all" */
+		luaL_argcheck(L, strcmp(lua_tostring(L, -1), "all") == 0, 1, "invalid netns");
+	else if (lua_isnil(L, -1))
+		net = get_net(&init_net);
+	else if (IS_ERR(net = get_net_ns_by_pid((pid_t)luaL_checkinteger(L, -1))))
+		luaL_argerror(L, 1, "netns not found");
+	lua_pop(L, 1);
+
+	if (all) {
+		mutex_lock(&luanetfilter_mutex);
+		list_add_tail(&nf->node, &luanetfilter_all);
+		mutex_unlock(&luanetfilter_mutex);
+
+		memset(&nf->pernet, 0, sizeof(struct pernet_operations));
+		nf->pernet.init = luanetfilter_net_sync;
+		nf->all = (ret = register_pernet_subsys(&nf->pernet)) == 0;
+	}
+	else {
+		mutex_lock(&luanetfilter_mutex);
+		ret = luanetfilter_bind(net, nf);
+		mutex_unlock(&luanetfilter_mutex);
+		put_net(net);
+	}
+
+	if (ret != 0)
+		luaL_error(L, "failed to register netfilter hook");
+
 	lunatik_registerobject(L, 1, object);
 	return 1;
 }
 
 static const luaL_Reg luanetfilter_lib[] = {
 	{"register", luanetfilter_register},
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0))
+	{"queue", luanetfilter_queue},
+#endif
 	{NULL, NULL},
 };
 
@@ -143,20 +913,33 @@ static void luanetfilter_release(void *private)
 	if (!nf->runtime)
 		return;
 
-	nf_unregister_net_hook(&init_net, &nf->nfops);
+	luanetfilter_unbindall(nf);
 	lunatik_putobject(nf->runtime);
 	nf->runtime = NULL;
 }
 
-LUNATIK_NEWLIB(netfilter, luanetfilter_lib, &luanetfilter_class, luanetfilter_flags);
+int luaopen_netfilter(lua_State *L);
+int luaopen_netfilter(lua_State *L)
+{
+	luaL_newlib(L, luanetfilter_lib);
+	lunatik_checkclass(L, &luanetfilter_class);
+	lunatik_newclass(L, &luanetfilter_class);
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0))
+	lunatik_newclass(L, &luanetfilter_queue_class);
+#endif
+	lunatik_newnamespaces(L, luanetfilter_flags);
+	return 1;
+}
+EXPORT_SYMBOL_GPL(luaopen_netfilter);
 
 static int __init luanetfilter_init(void)
 {
-    return 0;
+	return register_pernet_subsys(&luanetfilter_net_ops);
 }
 
 static void __exit luanetfilter_exit(void)
 {
+	unregister_pernet_subsys(&luanetfilter_net_ops);
 }
 
 module_init(luanetfilter_init);
@@ -11,6 +11,7 @@
 #include <linux/netfilter_bridge.h>
 #include <linux/netfilter_arp.h>
 #include <linux/netfilter/x_tables.h>
+#include <linux/netfilter/nf_conntrack_common.h>
 
 #include <lunatik.h>
 
@@ -125,6 +126,29 @@ static const lunatik_reg_t luanetfilter_bridge_priority[] = {
 	{NULL, 0},
 };
 
+static const lunatik_reg_t luanetfilter_ctinfo[] = {
+	{"ESTABLISHED", IP_CT_ESTABLISHED},
+	{"RELATED", IP_CT_RELATED},
+	{"NEW", IP_CT_NEW},
+	{"ESTABLISHED_REPLY", IP_CT_ESTABLISHED_REPLY},
+	{"RELATED_REPLY", IP_CT_RELATED_REPLY},
+	{NULL, 0},
+};
+
+static const lunatik_reg_t luanetfilter_ctstatus[] = {
+	{"EXPECTED", IPS_EXPECTED},
+	{"SEEN_REPLY", IPS_SEEN_REPLY},
+	{"ASSURED", IPS_ASSURED},
+	{"CONFIRMED", IPS_CONFIRMED},
+	{"SRC_NAT", IPS_SRC_NAT},
+	{"DST_NAT", IPS_DST_NAT},
+	{"SEQ_ADJUST", IPS_SEQ_ADJUST},
+	{"DYING", IPS_DYING},
+	{"FIXED_TIMEOUT", IPS_FIXED_TIMEOUT},
+	{"TEMPLATE", IPS_TEMPLATE},
+	{NULL, 0},
+};
+
 static const lunatik_namespace_t luanetfilter_flags[] = {
 	{"family", luanetfilter_family},
 	{"action", luanetfilter_action},
@@ -134,6 +158,8 @@ static const lunatik_namespace_t luanetfilter_flags[] = {
 	{"netdev_hooks", luanetfilter_netdev_hooks},
 	{"ip_priority", luanetfilter_ip_priority},
 	{"bridge_priority", luanetfilter_bridge_priority},
+	{"ctinfo", luanetfilter_ctinfo},
+	{"ctstatus", luanetfilter_ctstatus},
 	{NULL, NULL}
 };
 
@@ -17,6 +17,8 @@
 typedef struct luaprobe_s {
 	struct kprobe kp;
 	lunatik_object_t *runtime;
+	int pre; /* handler references */
+	int post;
 } luaprobe_t;
 
 static void (*luaprobe_showregs)(struct pt_regs *);
@@ -31,17 +33,12 @@ static int luaprobe_dump(lua_State *L)
 	return 0;
 }
 
-static int luaprobe_handler(lua_State *L, luaprobe_t *probe, const char *handler, struct pt_regs *regs)
+static int luaprobe_handler(lua_State *L, luaprobe_t *probe, const char *handler, int ref, struct pt_regs *regs)
 {
 	struct kprobe *kp = &probe->kp;
 	const char *symbol = kp->symbol_name;
 
-	if (lunatik_getregistry(L, probe) != LUA_TTABLE) {
-		pr_err("couldn't find probe table\n");
-		goto out;
-	}
-
-	if (lua_getfield(L, -1, handler) != LUA_TFUNCTION) {
+	if (lunatik_getref(L, ref) != LUA_TFUNCTION) {
 		pr_err("%s handler isn't defined\n", handler);
 		goto out;
 	}
@@ -70,7 +67,7 @@ static int __kprobes luaprobe_pre_handler(struct kprobe *kp, struct pt_regs *reg
 	luaprobe_t *probe = container_of(kp, luaprobe_t, kp);
 	int ret;
 
-	lunatik_run(probe->runtime, luaprobe_handler, ret, probe, "pre", regs);
+	lunatik_run(probe->runtime, luaprobe_handler, ret, probe, "pre", probe->pre, regs);
 	return ret;
 }
 
@@ -80,7 +77,7 @@ static void __kprobes luaprobe_post_handler(struct kprobe *kp, struct pt_regs *r
 	int ret;
 
 	/* flags always seems to be zero; see:https://docs.kernel.org/trace/kprobes.html#api-reference */
-	lunatik_run(probe->runtime, luaprobe_handler, ret, probe, "post", regs);
+	lunatik_run(probe->runtime, luaprobe_handler, ret, probe, "post", probe->post, regs);
 	(void)ret;
 }
 
@@ -120,8 +117,11 @@ static int luaprobe_stop(lua_State *L)
 	luaprobe_delete(probe);
 	lunatik_unlock(object);
 
-	if (lunatik_toruntime(L) == probe->runtime)
+	if (lunatik_toruntime(L) == probe->runtime) {
+		lunatik_unref(L, &probe->pre);
+		lunatik_unref(L, &probe->post);
 		lunatik_unregisterobject(L, object);
+	}
 	return 0;
 }
 
@@ -149,6 +149,23 @@ err:
 	return luaL_argerror(L, 1, LUNATIK_ERR_NULLPTR);
 }
 
+static inline void luaprobe_sethandlers(lua_State *L, int ix, luaprobe_t *probe)
+{
+	lunatik_setfieldref(L, ix, "pre", &probe->pre);
+	lunatik_setfieldref(L, ix, "post", &probe->post);
+}
+
+static int luaprobe_update(lua_State *L)
+{
+	lunatik_object_t *object = lunatik_checkobject(L, 1);
+	luaprobe_t *probe = (luaprobe_t *)object->private;
+
+	lunatik_checkupdate(L, probe->runtime);
+	luaprobe_sethandlers(L, 2, probe);
+	lunatik_setregistry(L, 2, probe); /* handlers */
+	return 0;
+}
+
 static int luaprobe_new(lua_State *L);
 
 static const luaL_Reg luaprobe_lib[] = {
@@ -160,6 +177,7 @@ static const luaL_Reg luaprobe_mt[] = {
 	{"__gc", lunatik_deleteobject},
 	{"stop", luaprobe_stop},
 	{"enable", luaprobe_enable},
+	{"update", luaprobe_update},
 	{NULL, NULL}
 };
 
@@ -178,6 +196,8 @@ static int luaprobe_new(lua_State *L)
 	int ret;
 
 	memset(probe, 0, sizeof(luaprobe_t));
+	probe->pre = LUA_NOREF;
+	probe->post = LUA_NOREF;
 
 	lunatik_setruntime(L, probe, probe);
 	lunatik_getobject(probe->runtime);
@@ -193,6 +213,7 @@ static int luaprobe_new(lua_State *L)
 	}
 
 	luaL_checktype(L, 2, LUA_TTABLE); /* handlers */
+	luaprobe_sethandlers(L, 2, probe);
 
 	kp->pre_handler = luaprobe_pre_handler;
 	kp->post_handler = luaprobe_post_handler;
@@ -0,0 +1,168 @@
+/*
+* SPDX-FileCopyrightText: (c) 2024 Ring Zero Desenvolvimento de Software LTDA
+* SPDX-License-Identifier: MIT OR GPL-2.0-only
+*/
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/jhash.h>
+#include <linux/hash.h>
+#include <linux/random.h>
+#include <linux/jiffies.h>
+#include <linux/atomic.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include <lunatik.h>
+
+/*
+* each bucket is a single 64-bit word updated with cmpxchg;
+* the upper half holds the last refill time (in jiffies)
+* and the lower half holds the available tokens (in thousandths of a token)
+*/
+#define LUARATELIMIT_SCALE	(1000)
+#define LUARATELIMIT_BURSTMAX	(U32_MAX / LUARATELIMIT_SCALE)
+
+#define luaratelimit_pack(stamp, tokens)	(((u64)(stamp) << 32) | (u32)(tokens))
+#define luaratelimit_stamp(state)		((u32)((state) >> 32))
+#define luaratelimit_tokens(state)		((u32)(state))
+
+typedef struct luaratelimit_s {
+	u64 rate; /* tokens per second */
+	u64 burst;
+	u32 seed;
+	u32 mask;
+	atomic64_t buckets[];
+} luaratelimit_t;
+
+#define luaratelimit_sizeof(size)	(sizeof(luaratelimit_t) + sizeof(atomic64_t) * (size))
+
+static int luaratelimit_new(lua_State *L);
+
+LUNATIK_OBJECTCHECKER(luaratelimit_check, luaratelimit_t *);
+
+static inline u32 luaratelimit_hash(lua_State *L, luaratelimit_t *rl, int ix)
+{
+	if (lua_type(L, ix) == LUA_TSTRING) {
+		size_t len;
+		const char *key = lua_tolstring(L, ix, &len);
+		return jhash(key, len, rl->seed);
+	}
+	return hash_64((u64)luaL_checkinteger(L, ix) ^ rl->seed, 32);
+}
+
+static bool luaratelimit_consume(luaratelimit_t *rl, atomic64_t *bucket, u64 cost)
+{
+	u64 rate = READ_ONCE(rl->rate);
+	u64 burst = READ_ONCE(rl->burst) * LUARATELIMIT_SCALE;
+	u32 now = (u32)jiffies;
+	s64 old = atomic64_read(bucket);
+	s64 new;
+	bool allowed;
+
+	do {
+		u64 elapsed = jiffies_to_msecs((u32)(now - luaratelimit_stamp(old)));
+		u64 tokens = luaratelimit_tokens(old) + min_t(u64, elapsed * rate, burst);
+
+		tokens = min(tokens, burst);
+		if ((allowed = tokens >= cost))
+			tokens -= cost;
+		new = (s64)luaratelimit_pack(now, tokens);
+	} while (!atomic64_try_cmpxchg(bucket, &old, new));
+	return allowed;
+}
+
+static int luaratelimit_allow(lua_State *L)
+{
+	luaratelimit_t *rl = luaratelimit_check(L, 1);
+	u32 hash = luaratelimit_hash(L, rl, 2);
+	lua_Integer cost = luaL_optinteger(L, 3, 1);
+
+	luaL_argcheck(L, cost >= 0 && cost <= LUARATELIMIT_BURSTMAX, 3, "invalid cost");
+	lua_pushboolean(L, luaratelimit_consume(rl, &rl->buckets[hash & rl->mask], (u64)cost * LUARATELIMIT_SCALE));
+	return 1;
+}
+
+static inline void luaratelimit_checkrate(lua_State *L, luaratelimit_t *rl, int ix)
+{
+	lua_Integer rate = luaL_checkinteger(L, ix);
+	lua_Integer burst = luaL_optinteger(L, ix + 1, max_t(lua_Integer, rate, 1));
+
+	luaL_argcheck(L, rate >= 0 && rate <= LUARATELIMIT_BURSTMAX, ix, "invalid rate");
+	luaL_argcheck(L, burst > 0 && burst <= LUARATELIMIT_BURSTMAX, ix + 1, "invalid burst");
+	WRITE_ONCE(rl->rate, (u64)rate);
+	WRITE_ONCE(rl->burst, (u64)burst);
+}
+
+static int luaratelimit_set(lua_State *L)
+{
+	luaratelimit_t *rl = luaratelimit_check(L, 1);
+	luaratelimit_checkrate(L, rl, 2);
+	return 0;
+}
+
+static int luaratelimit_get(lua_State *L)
+{
+	luaratelimit_t *rl = luaratelimit_check(L, 1);
+	lua_pushinteger(L, (lua_Integer)READ_ONCE(rl->rate));
+	lua_pushinteger(L, (lua_Integer)READ_ONCE(rl->burst));
+	return 2;
+}
+
+static const luaL_Reg luaratelimit_lib[] = {
+	{"new", luaratelimit_new},
+	{NULL, NULL}
+};
+
+static const luaL_Reg luaratelimit_mt[] = {
+	{"__gc", lunatik_deleteobject},
+	{"allow", luaratelimit_allow},
+	{"set", luaratelimit_set},
+	{"get", luaratelimit_get},
+	{NULL, NULL}
+};
+
+static const lunatik_class_t luaratelimit_class = {
+	.name = "ratelimit",
+	.methods = luaratelimit_mt,
+	.sleep = false,
+};
+
+static int luaratelimit_new(lua_State *L)
+{
+	lua_Integer size = luaL_checkinteger(L, 1);
+	lunatik_object_t *object;
+	luaratelimit_t *rl;
+	size_t i;
+
+	luaL_argcheck(L, size > 0, 1, "invalid size");
+	size = roundup_pow_of_two(size);
+	object = lunatik_newobject(L, &luaratelimit_class, luaratelimit_sizeof(size));
+	rl = (luaratelimit_t *)object->private;
+
+	luaratelimit_checkrate(L, rl, 2);
+	rl->seed = get_random_u32();
+	rl->mask = size - 1;
+	for (i = 0; i < size; i++)
+		atomic64_set(&rl->buckets[i], 0);
+	return 1; /* object */
+}
+
+LUNATIK_NEWLIB(ratelimit, luaratelimit_lib, &luaratelimit_class, NULL);
+
+static int __init luaratelimit_init(void)
+{
+	return 0;
+}
+
+static void __exit luaratelimit_exit(void)
+{
+}
+
+module_init(luaratelimit_init);
+module_exit(luaratelimit_exit);
+MODULE_LICENSE("Dual MIT/GPL");
+MODULE_AUTHOR("Lourival Vieira Neto <lourival.neto@ring-0.io>");
+
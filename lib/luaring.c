@@ -0,0 +1,288 @@
+/*
+* SPDX-FileCopyrightText: (c) 2024 Ring Zero Desenvolvimento de Software LTDA
+* SPDX-License-Identifier: MIT OR GPL-2.0-only
+*/
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/kfifo.h>
+#include <linux/percpu.h>
+#include <linux/irqflags.h>
+
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include <lunatik.h>
+
+/*
+* records are stored with a 2-byte length header; kfifo needs no locking
+* with a single producer and a single consumer, so the MPSC mode gives each
+* CPU its own fifo, with interrupts disabled while producing
+*/
+typedef struct kfifo_rec_ptr_2 luaring_fifo_t;
+
+#define LUARING_RECMAX	(U16_MAX)
+
+typedef struct luaring_s {
+	luaring_fifo_t __percpu *percpu; /* MPSC */
+	luaring_fifo_t fifo; /* SPSC */
+	unsigned int next; /* next CPU to be consumed */
+	lunatik_object_t *producer; /* runtime bound as the single producer (SPSC only) */
+	lunatik_object_t *consumer; /* runtime bound as the single consumer */
+} luaring_t;
+
+static int luaring_new(lua_State *L);
+
+LUNATIK_OBJECTCHECKER(luaring_check, luaring_t *);
+
+static inline const char *luaring_checkrecord(lua_State *L, int ix, size_t *len)
+{
+	const char *record = luaL_checklstring(L, ix, len);
+	luaL_argcheck(L, *len > 0 && *len <= LUARING_RECMAX, ix, "invalid record length");
+	return record;
+}
+
+/* runtimes serialize their own calls, so binding each side to a single runtime keeps kfifo safe */
+static inline void luaring_bind(lua_State *L, lunatik_object_t **side, const char *role)
+{
+	lunatik_object_t *runtime = lunatik_toruntime(L);
+	lunatik_object_t *bound = cmpxchg(side, NULL, runtime);
+
+	if (bound != NULL && bound != runtime)
+		luaL_error(L, "ring already has a %s runtime", role);
+}
+
+#define luaring_checkproducer(L, ring)	\
+	do { if ((ring)->percpu == NULL) luaring_bind((L), &(ring)->producer, "producer"); } while (0)
+#define luaring_checkconsumer(L, ring)	luaring_bind((L), &(ring)->consumer, "consumer")
+
+#define luaring_in(fifo, record, len)	(kfifo_in((fifo), (record), (len)) == (len))
+
+static inline luaring_fifo_t *luaring_getproducer(luaring_t *ring, unsigned long *flags)
+{
+	if (ring->percpu == NULL)
+		return &ring->fifo;
+
+	local_irq_save(*flags);
+	return this_cpu_ptr(ring->percpu);
+}
+
+static inline void luaring_putproducer(luaring_t *ring, unsigned long flags)
+{
+	if (ring->percpu != NULL)
+		local_irq_restore(flags);
+}
+
+static int luaring_push(lua_State *L)
+{
+	luaring_t *ring = luaring_check(L, 1);
+	size_t len;
+	const char *record = luaring_checkrecord(L, 2, &len);
+	unsigned long flags = 0;
+	luaring_fifo_t *fifo;
+	bool pushed;
+
+	luaring_checkproducer(L, ring);
+	fifo = luaring_getproducer(ring, &flags);
+	pushed = luaring_in(fifo, record, len);
+
+	luaring_putproducer(ring, flags);
+	lua_pushboolean(L, pushed);
+	return 1;
+}
+
+static int luaring_pushmany(lua_State *L)
+{
+	luaring_t *ring = luaring_check(L, 1);
+	lua_Integer i, n;
+	luaring_fifo_t *fifo;
+	unsigned long flags = 0;
+	const char **records;
+	size_t *lens;
+
+	luaL_checktype(L, 2, LUA_TTABLE);
+	luaring_checkproducer(L, ring);
+	n = luaL_len(L, 2);
+	luaL_argcheck(L, n >= 0 && n <= INT_MAX / (sizeof(char *) + sizeof(size_t)), 2, "too many records");
+
+	/* checked beforehand, as we can't raise errors with interrupts disabled */
+	records = (const char **)lua_newuserdatauv(L, n * (sizeof(char *) + sizeof(size_t)), 0);
+	lens = (size_t *)&records[n];
+	for (i = 0; i < n; i++) {
+		lua_rawgeti(L, 2, i + 1);
+		luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, 2, "array of strings expected");
+		records[i] = lua_tolstring(L, -1, &lens[i]); /* anchored by records */
+		luaL_argcheck(L, lens[i] > 0 && lens[i] <= LUARING_RECMAX, 2, "invalid record length");
+		lua_pop(L, 1);
+	}
+
+	fifo = luaring_getproducer(ring, &flags);
+	for (i = 0; i < n; i++)
+		if (!luaring_in(fifo, records[i], lens[i]))
+			break;
+	luaring_putproducer(ring, flags);
+	lua_pushinteger(L, i);
+	return 1;
+}
+
+static luaring_fifo_t *luaring_consumer(luaring_t *ring)
+{
+	unsigned int cpu, n;
+
+	if (ring->percpu == NULL)
+		return kfifo_is_empty(&ring->fifo) ? NULL : &ring->fifo;
+
+	/* round-robin among CPUs, so a busy producer can't starve the others */
+	for (n = 0, cpu = ring->next; n < nr_cpu_ids; n++, cpu = (cpu + 1) % nr_cpu_ids) {
+		luaring_fifo_t *fifo;
+
+		if (!cpu_possible(cpu))
+			continue;
+
+		fifo = per_cpu_ptr(ring->percpu, cpu);
+		if (!kfifo_is_empty(fifo)) {
+			ring->next = (cpu + 1) % nr_cpu_ids;
+			return fifo;
+		}
+	}
+	return NULL;
+}
+
+static inline bool luaring_out(lua_State *L, luaring_t *ring)
+{
+	luaring_fifo_t *fifo = luaring_consumer(ring);
+	luaL_Buffer B;
+	unsigned int len;
+	char *buffer;
+
+	if (fifo == NULL)
+		return false;
+
+	len = kfifo_peek_len(fifo);
+	buffer = luaL_buffinitsize(L, &B, len);
+	len = kfifo_out(fifo, buffer, len);
+	luaL_pushresultsize(&B, len);
+	return true;
+}
+
+static int luaring_pop(lua_State *L)
+{
+	luaring_t *ring = luaring_check(L, 1);
+
+	luaring_checkconsumer(L, ring);
+	if (!luaring_out(L, ring))
+		lua_pushnil(L);
+	return 1;
+}
+
+static int luaring_popmany(lua_State *L)
+{
+	luaring_t *ring = luaring_check(L, 1);
+	lua_Integer n = luaL_optinteger(L, 2, LUA_MAXINTEGER);
+	lua_Integer i;
+
+	luaL_argcheck(L, n > 0, 2, "invalid number of records");
+	luaring_checkconsumer(L, ring);
+	lua_newtable(L);
+	for (i = 1; i <= n && luaring_out(L, ring); i++)
+		lua_rawseti(L, -2, i);
+	return 1; /* records */
+}
+
+/* methods don't lock the object, thus we can't free the fifos while another runtime might use them */
+static int luaring_close(lua_State *L)
+{
+	lunatik_object_t *object = lunatik_checkobject(L, 1);
+
+	luaL_argcheck(L, kref_read(&object->kref) == 1, 1, "cannot close a shared ring");
+	return lunatik_closeobject(L);
+}
+
+static void luaring_release(void *private)
+{
+	luaring_t *ring = (luaring_t *)private;
+
+	if (ring->percpu != NULL) {
+		int cpu;
+		for_each_possible_cpu(cpu)
+			kfifo_free(per_cpu_ptr(ring->percpu, cpu));
+		free_percpu(ring->percpu);
+	}
+	else
+		kfifo_free(&ring->fifo);
+}
+
+static const luaL_Reg luaring_lib[] = {
+	{"new", luaring_new},
+	{NULL, NULL}
+};
+
+static const luaL_Reg luaring_mt[] = {
+	{"__gc", lunatik_deleteobject},
+	{"__close", luaring_close},
+	{"close", luaring_close},
+	{"push", luaring_push},
+	{"pushmany", luaring_pushmany},
+	{"pop", luaring_pop},
+	{"popmany", luaring_popmany},
+	{NULL, NULL}
+};
+
+static const lunatik_class_t luaring_class = {
+	.name = "ring",
+	.methods = luaring_mt,
+	.release = luaring_release,
+	.sleep = false,
+};
+
+static int luaring_new(lua_State *L)
+{
+	lua_Integer size = luaL_checkinteger(L, 1);
+	bool percpu = lua_toboolean(L, 2);
+	lunatik_object_t *object;
+	luaring_t *ring;
+	gfp_t gfp = lunatik_gfp(lunatik_toruntime(L));
+	int cpu, ret = 0;
+
+	luaL_argcheck(L, size > 0 && size <= INT_MAX, 1, "invalid size");
+	object = lunatik_newobject(L, &luaring_class, sizeof(luaring_t));
+	ring = (luaring_t *)object->private;
+	memset(ring, 0, sizeof(luaring_t)); /* release() relies on zeroed fifos */
+
+	if (!percpu) {
+		if ((ret = kfifo_alloc(&ring->fifo, size, gfp)) != 0)
+			goto err;
+		return 1; /* object */
+	}
+
+	if ((ring->percpu = alloc_percpu_gfp(luaring_fifo_t, gfp | __GFP_ZERO)) == NULL) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	for_each_possible_cpu(cpu)
+		if ((ret = kfifo_alloc(per_cpu_ptr(ring->percpu, cpu), size, gfp)) != 0)
+			goto err; /* release frees the allocated ones (kfifo_free() handles zeroed fifos) */
+	return 1; /* object */
+err:
+	return luaL_error(L, "failed to allocate ring (%d)", ret);
+}
+
+LUNATIK_NEWLIB(ring, luaring_lib, &luaring_class, NULL);
+
+static int __init luaring_init(void)
+{
+	return 0;
+}
+
+static void __exit luaring_exit(void)
+{
+}
+
+module_init(luaring_init);
+module_exit(luaring_exit);
+MODULE_LICENSE("Dual MIT/GPL");
+MODULE_AUTHOR("Lourival Vieira Neto <lourival.neto@ring-0.io>");
+
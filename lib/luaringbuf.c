@@ -0,0 +1,294 @@
+/*
+* SPDX-FileCopyrightText: (c) 2024 Ring Zero Desenvolvimento de Software LTDA
+* SPDX-License-Identifier: MIT OR GPL-2.0-only
+*/
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/miscdevice.h>
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/kref.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include <lunatik.h>
+
+/*
+* the device file maps, in order: a page holding the consumer position (written by userspace),
+* a page holding the producer position and the size of the data area (written by us)
+* and the data area itself; positions are free-running byte counters (unsigned long)
+*/
+#define LUARINGBUF_CONSUMER	(0)
+#define LUARINGBUF_PRODUCER	(PAGE_SIZE)
+#define LUARINGBUF_DATA		(2 * PAGE_SIZE)
+#define LUARINGBUF_MAXSIZE	(1UL << 30)
+
+/* records are 8-byte aligned; a pad record skips to the beginning of the data area */
+typedef struct luaringbuf_hdr_s {
+	u32 len;
+	u32 flags;
+} luaringbuf_hdr_t;
+
+#define LUARINGBUF_PAD		(1U << 0)
+#define LUARINGBUF_HDRLEN	(sizeof(luaringbuf_hdr_t))
+#define LUARINGBUF_RECLEN(len)	(ALIGN(LUARINGBUF_HDRLEN + (len), LUARINGBUF_HDRLEN))
+
+typedef struct luaringbuf_s {
+	struct miscdevice misc;
+	struct kref kref; /* held by the object and by each open file */
+	struct work_struct destroy;
+	wait_queue_head_t wait;
+	spinlock_t lock; /* serializes producers */
+	unsigned long producer;
+	unsigned long size;
+	void *area;
+	unsigned long *pconsumer;
+	unsigned long *pproducer;
+	char *data;
+} luaringbuf_t;
+
+static struct workqueue_struct *luaringbuf_reaper;
+
+static int luaringbuf_new(lua_State *L);
+
+static void luaringbuf_free(struct kref *kref)
+{
+	luaringbuf_t *rb = container_of(kref, luaringbuf_t, kref);
+
+	vfree(rb->area);
+	kfree(rb->misc.name);
+	kfree(rb);
+}
+
+#define luaringbuf_get(rb)	kref_get(&(rb)->kref)
+#define luaringbuf_put(rb)	kref_put(&(rb)->kref, luaringbuf_free)
+
+#define luaringbuf_fromfile(f)	container_of((f)->private_data, luaringbuf_t, misc)
+
+/* misc_open() holds misc_mtx, which misc_deregister() also takes; so rb is still alive here */
+static int luaringbuf_fop_open(struct inode *inode, struct file *f)
+{
+	luaringbuf_get(luaringbuf_fromfile(f));
+	return 0;
+}
+
+static int luaringbuf_fop_release(struct inode *inode, struct file *f)
+{
+	luaringbuf_put(luaringbuf_fromfile(f));
+	return 0;
+}
+
+static __poll_t luaringbuf_fop_poll(struct file *f, struct poll_table_struct *wait)
+{
+	luaringbuf_t *rb = luaringbuf_fromfile(f);
+
+	poll_wait(f, &rb->wait, wait);
+	return smp_load_acquire(rb->pproducer) != READ_ONCE(*rb->pconsumer) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+static int luaringbuf_fop_mmap(struct file *f, struct vm_area_struct *vma)
+{
+	luaringbuf_t *rb = luaringbuf_fromfile(f);
+	return remap_vmalloc_range(vma, rb->area, vma->vm_pgoff);
+}
+
+static const struct file_operations luaringbuf_fops = {
+	.owner = THIS_MODULE,
+	.open = luaringbuf_fop_open,
+	.release = luaringbuf_fop_release,
+	.poll = luaringbuf_fop_poll,
+	.mmap = luaringbuf_fop_mmap,
+	.llseek = noop_llseek,
+};
+
+static inline void luaringbuf_sethdr(luaringbuf_t *rb, unsigned long pos, u32 len, u32 flags)
+{
+	luaringbuf_hdr_t *hdr = (luaringbuf_hdr_t *)&rb->data[pos & (rb->size - 1)];
+	hdr->len = len;
+	hdr->flags = flags;
+}
+
+static bool luaringbuf_write(luaringbuf_t *rb, const char *record, size_t len)
+{
+	size_t reclen = LUARINGBUF_RECLEN(len);
+	unsigned long producer, consumer, offset, pad, flags;
+	bool wakeup = false;
+
+	spin_lock_irqsave(&rb->lock, flags);
+	producer = rb->producer;
+	consumer = smp_load_acquire(rb->pconsumer); /* pairs with userspace store-release */
+
+	offset = producer & (rb->size - 1);
+	pad = offset + reclen > rb->size ? rb->size - offset : 0;
+
+	/* consumer is set by userspace, thus it can't be trusted */
+	if (producer - consumer > rb->size || producer - consumer + pad + reclen > rb->size) {
+		spin_unlock_irqrestore(&rb->lock, flags);
+		return false;
+	}
+
+	if (pad > 0)
+		luaringbuf_sethdr(rb, producer, pad - LUARINGBUF_HDRLEN, LUARINGBUF_PAD);
+
+	luaringbuf_sethdr(rb, producer + pad, len, 0);
+	memcpy(&rb->data[((producer + pad) & (rb->size - 1)) + LUARINGBUF_HDRLEN], record, len);
+
+	rb->producer = producer + pad + reclen;
+	smp_store_release(rb->pproducer, rb->producer);
+
+	/* consumers only sleep on an empty ring, so we wake them once per burst */
+	wakeup = consumer == producer;
+	spin_unlock_irqrestore(&rb->lock, flags);
+
+	if (wakeup)
+		wake_up_interruptible(&rb->wait);
+	return true;
+}
+
+/* closeobject() clears private under the object lock, so we can't race with the release */
+static luaringbuf_t *luaringbuf_acquire(lua_State *L, int ix)
+{
+	lunatik_object_t *object = lunatik_checkobject(L, ix);
+	luaringbuf_t *rb;
+
+	lunatik_lock(object);
+	if ((rb = (luaringbuf_t *)object->private) != NULL)
+		luaringbuf_get(rb);
+	lunatik_unlock(object);
+
+	lunatik_argchecknull(L, rb, ix);
+	return rb;
+}
+
+static int luaringbuf_submit(lua_State *L)
+{
+	size_t len;
+	const char *record = luaL_checklstring(L, 2, &len);
+	luaringbuf_t *rb = luaringbuf_acquire(L, 1);
+	bool toolong = LUARINGBUF_RECLEN(len) > rb->size;
+	bool ret = !toolong && luaringbuf_write(rb, record, len);
+
+	luaringbuf_put(rb);
+	luaL_argcheck(L, !toolong, 2, "record too long");
+	lua_pushboolean(L, ret);
+	return 1;
+}
+
+static int luaringbuf_len(lua_State *L)
+{
+	luaringbuf_t *rb = luaringbuf_acquire(L, 1);
+	unsigned long size = rb->size;
+
+	luaringbuf_put(rb);
+	lua_pushinteger(L, (lua_Integer)size);
+	return 1;
+}
+
+static void luaringbuf_destroy(struct work_struct *work)
+{
+	luaringbuf_t *rb = container_of(work, luaringbuf_t, destroy);
+
+	misc_deregister(&rb->misc);
+	luaringbuf_put(rb); /* open files keep the area alive */
+}
+
+/* objects might be released in atomic context, but misc_deregister() sleeps */
+static void luaringbuf_release(void *private)
+{
+	luaringbuf_t *rb = (luaringbuf_t *)private;
+
+	INIT_WORK(&rb->destroy, luaringbuf_destroy);
+	queue_work(luaringbuf_reaper, &rb->destroy);
+}
+
+static const luaL_Reg luaringbuf_lib[] = {
+	{"new", luaringbuf_new},
+	{NULL, NULL}
+};
+
+static const luaL_Reg luaringbuf_mt[] = {
+	{"__gc", lunatik_deleteobject},
+	{"__close", lunatik_closeobject},
+	{"__len", luaringbuf_len},
+	{"close", lunatik_closeobject},
+	{"submit", luaringbuf_submit},
+	{NULL, NULL}
+};
+
+static const lunatik_class_t luaringbuf_class = {
+	.name = "ringbuf",
+	.methods = luaringbuf_mt,
+	.release = luaringbuf_release,
+	.sleep = false,
+	.pointer = true,
+};
+
+static int luaringbuf_new(lua_State *L)
+{
+	const char *name = luaL_checkstring(L, 1);
+	lua_Integer size = luaL_checkinteger(L, 2);
+	umode_t mode = (umode_t)luaL_optinteger(L, 3, 0600);
+	lunatik_object_t *object;
+	luaringbuf_t *rb;
+
+	luaL_argcheck(L, size > 0 && size <= LUARINGBUF_MAXSIZE, 2, "invalid size");
+	lunatik_checkruntime(L, true);
+
+	object = lunatik_newobject(L, &luaringbuf_class, 0);
+	rb = (luaringbuf_t *)lunatik_checkalloc(L, sizeof(luaringbuf_t));
+	memset(rb, 0, sizeof(luaringbuf_t));
+
+	rb->size = roundup_pow_of_two(max_t(unsigned long, size, PAGE_SIZE));
+	if ((rb->area = vmalloc_user(LUARINGBUF_DATA + rb->size)) == NULL) {
+		lunatik_free(rb);
+		luaL_error(L, "failed to allocate ring buffer");
+	}
+
+	rb->pconsumer = (unsigned long *)((char *)rb->area + LUARINGBUF_CONSUMER);
+	rb->pproducer = (unsigned long *)((char *)rb->area + LUARINGBUF_PRODUCER);
+	rb->data = (char *)rb->area + LUARINGBUF_DATA;
+	rb->pproducer[1] = rb->size; /* exported right after the producer position */
+
+	kref_init(&rb->kref);
+	spin_lock_init(&rb->lock);
+	init_waitqueue_head(&rb->wait);
+
+	rb->misc.minor = MISC_DYNAMIC_MINOR;
+	rb->misc.fops = &luaringbuf_fops;
+	rb->misc.mode = mode;
+	rb->misc.name = kstrdup(name, GFP_KERNEL);
+	if (rb->misc.name == NULL || misc_register(&rb->misc) != 0) {
+		luaringbuf_put(rb);
+		luaL_error(L, "failed to register device '%s'", name);
+	}
+
+	object->private = rb;
+	return 1; /* object */
+}
+
+LUNATIK_NEWLIB(ringbuf, luaringbuf_lib, &luaringbuf_class, NULL);
+
+static int __init luaringbuf_init(void)
+{
+	luaringbuf_reaper = alloc_workqueue("luaringbuf", WQ_UNBOUND, 0);
+	return luaringbuf_reaper == NULL ? -ENOMEM : 0;
+}
+
+static void __exit luaringbuf_exit(void)
+{
+	destroy_workqueue(luaringbuf_reaper);
+}
+
+module_init(luaringbuf_init);
+module_exit(luaringbuf_exit);
+MODULE_LICENSE("Dual MIT/GPL");
+MODULE_AUTHOR("Lourival Vieira Neto <lourival.neto@ring-0.io>");
+
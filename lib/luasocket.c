@@ -7,8 +7,21 @@
 #include <linux/module.h>
 #include <linux/string.h>
 #include <linux/net.h>
+#include <linux/in6.h>
+#include <linux/uio.h>
+#include <linux/poll.h>
+#include <linux/hashtable.h>
+#include <linux/kthread.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
+#include <linux/tls.h>
+#include <linux/fs.h>
+#include <linux/splice.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/bvec.h>
 #include <linux/version.h>
 #include <net/sock.h>
+#include <net/tcp.h>
 #if (LINUX_VERSION_CODE <= KERNEL_VERSION(6, 1, 0))
 #include <linux/l2tp.h>
 #endif
@@ -19,6 +32,8 @@
 
 #include <lunatik.h>
 
+#include "luadata.h"
+
 #define luasocket_tryret(L, ret, op, ...)			\
 do {								\
 	if ((ret = op(__VA_ARGS__)) < 0) {			\
@@ -33,60 +48,93 @@ do {								\
 	luasocket_tryret(L, ret, op, __VA_ARGS__);		\
 } while(0)
 
-#define luasocket_msgaddr(msg, addr)		\
+#define luasocket_msgaddr(msg, addr, len)	\
 do {						\
-	msg.msg_namelen = sizeof(addr);		\
+	msg.msg_namelen = (len);		\
 	msg.msg_name = &addr;			\
 } while(0)
 
-#define LUASOCKET_SOCKADDR(addr)	(struct sockaddr *)&addr, sizeof(addr)
-#define LUASOCKET_ADDRMAX		(sizeof(struct sockaddr_ll)) /* AF_PACKET */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 80)
-#define LUASOCKET_ADDRMIN(addr)	(sizeof((addr)->sa_data_min))
-#else
-#define LUASOCKET_ADDRMIN(addr)	(sizeof((addr)->sa_data))
-#endif
-#define LUASOCKET_ADDRLEN		(LUASOCKET_ADDRMAX - sizeof(unsigned short))
+#define LUASOCKET_SOCKADDR(addr, len)	(struct sockaddr *)&addr, (len)
+#define LUASOCKET_ADDRLEN		(sizeof(luasocket_addr_t) - sizeof(sa_family_t))
 
-typedef struct luasocket_addr_s {
-	unsigned short family;
-	unsigned char data[LUASOCKET_ADDRLEN];
-} luasocket_addr_t;
+typedef struct sockaddr_storage luasocket_addr_t;
 
 static int luasocket_new(lua_State *L);
 static int luasocket_accept(lua_State *L);
 
-static void luasocket_checkaddr(lua_State *L, struct socket *socket, luasocket_addr_t *addr, int ix)
+/* number of Lua arguments taken by an address of the given family */
+static inline int luasocket_addrargs(int family)
+{
+	return family == AF_INET6 ? 4 : family == AF_INET ? 2 : 1;
+}
+
+static inline void luasocket_checkbinaddr(lua_State *L, int ix, void *dst, size_t size)
+{
+	size_t len;
+	const char *addr = luaL_checklstring(L, ix, &len);
+	luaL_argcheck(L, len == size, ix, "invalid address");
+	memcpy(dst, addr, size);
+}
+
+static int luasocket_checkaddr(lua_State *L, struct socket *socket, luasocket_addr_t *addr, int ix)
 {
-	addr->family = socket->sk->sk_family;
-	if (addr->family == AF_INET) {
+	int len;
+
+	memset(addr, 0, sizeof(luasocket_addr_t));
+	addr->ss_family = socket->sk->sk_family;
+	if (addr->ss_family == AF_INET) {
 		struct sockaddr_in *addr_in = (struct sockaddr_in *)addr;
-		addr_in->sin_addr.s_addr = htonl((u32)luaL_checkinteger(L, ix));
+		if (lua_type(L, ix) == LUA_TSTRING) /* network byte order */
+			luasocket_checkbinaddr(L, ix, &addr_in->sin_addr, sizeof(struct in_addr));
+		else
+			addr_in->sin_addr.s_addr = htonl((u32)luaL_checkinteger(L, ix));
 		addr_in->sin_port = htons((u16)luaL_checkinteger(L, ix + 1));
+		len = sizeof(struct sockaddr_in);
+	}
+	else if (addr->ss_family == AF_INET6) {
+		struct sockaddr_in6 *addr_in6 = (struct sockaddr_in6 *)addr;
+		luasocket_checkbinaddr(L, ix, &addr_in6->sin6_addr, sizeof(struct in6_addr));
+		addr_in6->sin6_port = htons((u16)luaL_checkinteger(L, ix + 1));
+		addr_in6->sin6_flowinfo = htonl((u32)luaL_optinteger(L, ix + 2, 0));
+		addr_in6->sin6_scope_id = (u32)luaL_optinteger(L, ix + 3, 0);
+		len = sizeof(struct sockaddr_in6);
 	}
-	else if (addr->family == AF_PACKET) {
+	else if (addr->ss_family == AF_PACKET) {
 		struct sockaddr_ll *addr_ll = (struct sockaddr_ll *)addr;
 		addr_ll->sll_ifindex = (int)luaL_checkinteger(L, ix);
+		len = sizeof(struct sockaddr_ll);
 	}
-	else {
-		size_t len;
-		const char *addr_data = luaL_checklstring(L, ix, &len);
-		memcpy(addr->data, addr_data, min(LUASOCKET_ADDRLEN, len));
+	else { /* sa_data is declared with 14 bytes (before 6.2), thus we copy through the storage */
+		size_t datalen;
+		const char *addr_data = luaL_checklstring(L, ix, &datalen);
+
+		datalen = min(LUASOCKET_ADDRLEN, datalen);
+		memcpy(addr->__data, addr_data, datalen);
+		len = sizeof(sa_family_t) + datalen;
 	}
+	return len;
 }
 
-static int luasocket_pushaddr(lua_State *L, struct sockaddr *addr)
+static int luasocket_pushaddr(lua_State *L, luasocket_addr_t *addr, int len)
 {
 	int n;
-	if (addr->sa_family == AF_INET) {
+	if (addr->ss_family == AF_INET) {
 		struct sockaddr_in *addr_in = (struct sockaddr_in *)addr;
 		lua_pushinteger(L, (lua_Integer)ntohl(addr_in->sin_addr.s_addr));
 		lua_pushinteger(L, (lua_Integer)ntohs(addr_in->sin_port));
 		n = 2;
 	}
+	else if (addr->ss_family == AF_INET6) {
+		struct sockaddr_in6 *addr_in6 = (struct sockaddr_in6 *)addr;
+		lua_pushlstring(L, (const char *)&addr_in6->sin6_addr, sizeof(struct in6_addr));
+		lua_pushinteger(L, (lua_Integer)ntohs(addr_in6->sin6_port));
+		lua_pushinteger(L, (lua_Integer)ntohl(addr_in6->sin6_flowinfo));
+		lua_pushinteger(L, (lua_Integer)addr_in6->sin6_scope_id);
+		n = 4;
+	}
 	else {
-		const char *addr_data = addr->sa_data;
-		lua_pushlstring(L, addr_data, LUASOCKET_ADDRMIN(addr));
+		len = clamp_t(int, len - (int)sizeof(sa_family_t), 0, LUASOCKET_ADDRLEN);
+		lua_pushlstring(L, addr->__data, (size_t)len);
 		n = 1;
 	}
 	return n;
@@ -112,8 +160,8 @@ static int luasocket_send(lua_State *L)
 
 	if (unlikely(nargs >= 3)) {
 		luasocket_addr_t addr;
-		luasocket_checkaddr(L, socket, &addr, 3);
-		luasocket_msgaddr(msg, addr);
+		int addrlen = luasocket_checkaddr(L, socket, &addr, 3);
+		luasocket_msgaddr(msg, addr, addrlen);
 	}
 
 	luasocket_tryret(L, ret, kernel_sendmsg, socket, &msg, &vec, 1, len);
@@ -128,7 +176,7 @@ static int luasocket_receive(lua_State *L)
 	luaL_Buffer B;
 	struct kvec vec;
 	struct msghdr msg;
-	struct sockaddr addr;
+	luasocket_addr_t addr;
 	int flags = luaL_optinteger(L, 3, 0);
 	int from = lua_toboolean(L, 4);
 	int ret;
@@ -139,21 +187,242 @@ static int luasocket_receive(lua_State *L)
 	vec.iov_len = len;
 
 	if (unlikely(from))
-		luasocket_msgaddr(msg, addr);
+		luasocket_msgaddr(msg, addr, sizeof(addr));
 
 	luasocket_tryret(L, ret, kernel_recvmsg, socket, &msg, &vec, 1, len, flags);
 	luaL_pushresultsize(&B, ret);
 
-	return unlikely(from) ? luasocket_pushaddr(L, (struct sockaddr *)msg.msg_name) + 1 : 1;
+	return unlikely(from) ? luasocket_pushaddr(L, &addr, msg.msg_namelen) + 1 : 1;
+}
+
+static inline char *luasocket_checkslice(lua_State *L, int ix, size_t *len, bool writable)
+{
+	size_t size;
+	char *buffer = luadata_checkbuffer(L, ix, &size, writable);
+	lua_Integer offset = luaL_checkinteger(L, ix + 1);
+	lua_Integer length = luaL_optinteger(L, ix + 2, (lua_Integer)size - offset);
+
+	luaL_argcheck(L, offset >= 0 && length >= 0 && (size_t)(offset + length) <= size, ix + 1, "out of bounds");
+	*len = (size_t)length;
+	return buffer + offset;
+}
+
+static int luasocket_sendfrom(lua_State *L)
+{
+	struct socket *socket = luasocket_check(L, 1);
+	struct kvec vec;
+	struct msghdr msg;
+	int nargs = lua_gettop(L);
+	int ret;
+
+	luasocket_setmsg(msg);
+	vec.iov_base = luasocket_checkslice(L, 2, &vec.iov_len, false);
+
+	if (unlikely(nargs >= 5)) {
+		luasocket_addr_t addr;
+		int addrlen = luasocket_checkaddr(L, socket, &addr, 5);
+		luasocket_msgaddr(msg, addr, addrlen);
+	}
+
+	luasocket_tryret(L, ret, kernel_sendmsg, socket, &msg, &vec, 1, vec.iov_len);
+	lua_pushinteger(L, ret);
+	return 1;
+}
+
+static int luasocket_receiveinto(lua_State *L)
+{
+	struct socket *socket = luasocket_check(L, 1);
+	struct kvec vec;
+	struct msghdr msg;
+	luasocket_addr_t addr;
+	int flags = luaL_optinteger(L, 5, 0);
+	int from = lua_toboolean(L, 6);
+	int ret;
+
+	luasocket_setmsg(msg);
+	vec.iov_base = luasocket_checkslice(L, 2, &vec.iov_len, true);
+
+	if (unlikely(from))
+		luasocket_msgaddr(msg, addr, sizeof(addr));
+
+	luasocket_tryret(L, ret, kernel_recvmsg, socket, &msg, &vec, 1, vec.iov_len, flags);
+	lua_pushinteger(L, ret);
+
+	return unlikely(from) ? luasocket_pushaddr(L, &addr, msg.msg_namelen) + 1 : 1;
+}
+
+#define luasocket_checkbatch(L, ix, n)	\
+	luaL_argcheck((L), (n) > 0 && (n) <= UIO_MAXIOV, (ix), "invalid batch size")
+
+static int luasocket_sendmany(lua_State *L)
+{
+	struct socket *socket = luasocket_check(L, 1);
+	int nargs = lua_gettop(L);
+	lua_Integer n, i, count = 0;
+	size_t total = 0, sent = 0;
+	luasocket_addr_t addr;
+	int addrlen = 0;
+	struct msghdr msg;
+	struct kvec *vec;
+	int ret;
+
+	luaL_checktype(L, 2, LUA_TTABLE);
+	n = luaL_len(L, 2);
+	luasocket_checkbatch(L, 2, n);
+	if (unlikely(nargs >= 3))
+		addrlen = luasocket_checkaddr(L, socket, &addr, 3);
+
+	vec = (struct kvec *)lua_newuserdatauv(L, sizeof(struct kvec) * n, 0);
+	for (i = 0; i < n; i++) {
+		size_t len;
+		lua_rawgeti(L, 2, i + 1);
+		luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, 2, "array of strings expected");
+		vec[i].iov_base = (void *)lua_tolstring(L, -1, &len); /* anchored by msgs */
+		vec[i].iov_len = len;
+		total += len;
+		lua_pop(L, 1);
+	}
+
+	if (socket->type == SOCK_STREAM) { /* gather all messages on a single call */
+		size_t left;
+
+		luasocket_setmsg(msg);
+		luasocket_tryret(L, ret, kernel_sendmsg, socket, &msg, vec, n, total);
+		for (left = sent = (size_t)ret; count < n && vec[count].iov_len <= left; count++)
+			left -= vec[count].iov_len;
+	}
+	else { /* one datagram per message */
+		for (; count < n; count++) {
+			luasocket_setmsg(msg);
+			if (unlikely(nargs >= 3))
+				luasocket_msgaddr(msg, addr, addrlen);
+
+			if ((ret = kernel_sendmsg(socket, &msg, &vec[count], 1, vec[count].iov_len)) < 0) {
+				if (count == 0) {
+					lua_pushinteger(L, -ret);
+					lua_error(L);
+				}
+				break;
+			}
+			sent += ret;
+		}
+	}
+	lua_pushinteger(L, count);
+	lua_pushinteger(L, (lua_Integer)sent);
+	return 2;
+}
+
+static int luasocket_receivemany(lua_State *L)
+{
+	struct socket *socket = luasocket_check(L, 1);
+	lua_Integer n = luaL_checkinteger(L, 2);
+	size_t size = (size_t)luaL_checkinteger(L, 3);
+	int flags = luaL_optinteger(L, 4, 0);
+	char *buffer = NULL;
+	lua_Integer i;
+
+	luasocket_checkbatch(L, 2, n);
+	if (!lua_isnoneornil(L, 5)) {
+		size_t length;
+		buffer = luadata_checkbuffer(L, 5, &length, true);
+		luaL_argcheck(L, size <= length / n, 5, "out of bounds");
+	}
+
+	lua_createtable(L, (int)n, 0);
+	for (i = 0; i < n; i++) {
+		luaL_Buffer B;
+		struct kvec vec;
+		struct msghdr msg;
+		int ret;
+
+		luasocket_setmsg(msg);
+		vec.iov_base = buffer != NULL ? buffer + i * size : (void *)luaL_buffinitsize(L, &B, size);
+		vec.iov_len = size;
+
+		/* only the first message might block */
+		ret = kernel_recvmsg(socket, &msg, &vec, 1, size, i == 0 ? flags : flags | MSG_DONTWAIT);
+		if (buffer == NULL)
+			luaL_pushresultsize(&B, ret < 0 ? 0 : ret);
+		else
+			lua_pushinteger(L, ret);
+
+		if (ret < 0) {
+			if (i == 0) {
+				lua_pushinteger(L, -ret);
+				lua_error(L);
+			}
+			lua_pop(L, 1);
+			break;
+		}
+		lua_rawseti(L, -2, i + 1);
+	}
+	return 1; /* batch */
+}
+
+static int luasocket_splicepage(struct pipe_inode_info *pipe, struct pipe_buffer *buf, struct splice_desc *sd)
+{
+	struct socket *socket = (struct socket *)sd->u.data;
+	int flags = sd->len < sd->total_len ? MSG_MORE : 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+	struct bio_vec bvec;
+	struct msghdr msg;
+
+	luasocket_setmsg(msg);
+	msg.msg_flags = MSG_SPLICE_PAGES | flags;
+	bvec_set_page(&bvec, buf->page, sd->len, buf->offset);
+	iov_iter_bvec(&msg.msg_iter, ITER_SOURCE, &bvec, 1, sd->len);
+	return sock_sendmsg(socket, &msg);
+#else
+	return kernel_sendpage(socket, buf->page, buf->offset, sd->len, flags);
+#endif
+}
+
+static int luasocket_spliceactor(struct pipe_inode_info *pipe, struct splice_desc *sd)
+{
+	return __splice_from_pipe(pipe, sd, luasocket_splicepage);
+}
+
+static int luasocket_sendfile(lua_State *L)
+{
+	struct socket *socket = luasocket_check(L, 1);
+	const char *path = luaL_checkstring(L, 2);
+	lua_Integer offset = luaL_optinteger(L, 3, 0);
+	lua_Integer length = luaL_optinteger(L, 4, -1); /* up to the end of file */
+	struct splice_desc sd = {.u.data = socket};
+	struct file *file;
+	loff_t size;
+	long ret;
+
+	luaL_argcheck(L, offset >= 0, 3, "invalid offset");
+	file = filp_open(path, O_RDONLY | O_LARGEFILE, 0);
+	if (IS_ERR(file)) {
+		lua_pushinteger(L, -PTR_ERR(file));
+		return lua_error(L);
+	}
+
+	size = i_size_read(file_inode(file));
+	sd.total_len = length >= 0 ? (size_t)length : offset < size ? (size_t)(size - offset) : 0;
+	sd.pos = (loff_t)offset;
+
+	/* page cache pages are spliced into an internal pipe and sent from there */
+	ret = sd.total_len > 0 ? splice_direct_to_actor(file, &sd, luasocket_spliceactor) : 0;
+	filp_close(file, NULL);
+
+	if (ret < 0) {
+		lua_pushinteger(L, -ret);
+		return lua_error(L);
+	}
+	lua_pushinteger(L, (lua_Integer)ret);
+	return 1;
 }
 
 static int luasocket_bind(lua_State *L)
 {
 	struct socket *socket = luasocket_check(L, 1);
 	luasocket_addr_t addr;
+	int addrlen = luasocket_checkaddr(L, socket, &addr, 2);
 
-	luasocket_checkaddr(L, socket, &addr, 2);
-	luasocket_try(L, kernel_bind, socket, LUASOCKET_SOCKADDR(addr));
+	luasocket_try(L, kernel_bind, socket, LUASOCKET_SOCKADDR(addr, addrlen));
 	return 0;
 }
 
@@ -170,13 +439,10 @@ static int luasocket_connect(lua_State *L)
 {
 	struct socket *socket = luasocket_check(L, 1);
 	luasocket_addr_t addr;
-	int nargs = lua_gettop(L);
-	int flags;
-
-	luasocket_checkaddr(L, socket, &addr, 2);
-	flags = luaL_optinteger(L, nargs, 0);
+	int addrlen = luasocket_checkaddr(L, socket, &addr, 2);
+	int flags = luaL_optinteger(L, 2 + luasocket_addrargs(addr.ss_family), 0);
 
-	luasocket_try(L, kernel_connect, socket, LUASOCKET_SOCKADDR(addr), flags);
+	luasocket_try(L, kernel_connect, socket, LUASOCKET_SOCKADDR(addr, addrlen), flags);
 	return 0;
 }
 
@@ -184,23 +450,294 @@ static int luasocket_connect(lua_State *L)
 static int luasocket_get##what(lua_State *L)			\
 {								\
 	struct socket *socket = luasocket_check(L, 1);		\
-	struct sockaddr addr;					\
-	luasocket_try(L, kernel_get##what, socket, &addr);	\
-	return luasocket_pushaddr(L, &addr);			\
+	luasocket_addr_t addr;					\
+	int ret;						\
+	luasocket_tryret(L, ret, kernel_get##what, socket,	\
+		(struct sockaddr *)&addr);			\
+	return luasocket_pushaddr(L, &addr, ret);		\
 }
 
 LUASOCKET_NEWGETTER(sockname);
 LUASOCKET_NEWGETTER(peername);
 
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0))
+static int luasocket_setsockopt(struct socket *socket, int level, int optname, void *optval, unsigned int optlen)
+{
+	sockptr_t ptr = KERNEL_SOCKPTR(optval);
+
+	if (level == SOL_SOCKET)
+		return sock_setsockopt(socket, level, optname, ptr, optlen);
+	else if (socket->ops->setsockopt != NULL)
+		return socket->ops->setsockopt(socket, level, optname, ptr, optlen);
+	return -EOPNOTSUPP;
+}
+#else /* sockptr_t was introduced (and kernel_setsockopt() removed) in 5.9 */
+#define luasocket_setsockopt(socket, level, optname, optval, optlen)	\
+	kernel_setsockopt((socket), (level), (optname), (char *)(optval), (optlen))
+#endif
+
+static int luasocket_setopt(lua_State *L)
+{
+	struct socket *socket = luasocket_check(L, 1);
+	int level = (int)luaL_checkinteger(L, 2);
+	int optname = (int)luaL_checkinteger(L, 3);
+	unsigned int optlen;
+	void *optval;
+	int value;
+
+	if (lua_type(L, 4) == LUA_TSTRING) { /* e.g., BINDTODEVICE, CONGESTION or packed structs */
+		size_t len;
+		optval = (void *)lua_tolstring(L, 4, &len);
+		optlen = (unsigned int)len;
+	}
+	else {
+		value = lua_isboolean(L, 4) ? lua_toboolean(L, 4) : (int)luaL_checkinteger(L, 4);
+		optval = &value;
+		optlen = sizeof(value);
+	}
+
+	luasocket_try(L, luasocket_setsockopt, socket, level, optname, optval, optlen);
+	return 0;
+}
+
+static int luasocket_getsolopt(struct sock *sk, int optname, int *value)
+{
+	switch (optname) {
+	case SO_TYPE:
+		*value = sk->sk_type;
+		break;
+	case SO_PROTOCOL:
+		*value = sk->sk_protocol;
+		break;
+	case SO_DOMAIN:
+		*value = sk->sk_family;
+		break;
+	case SO_ERROR:
+		*value = -sock_error(sk);
+		break;
+	case SO_ACCEPTCONN:
+		*value = sk->sk_state == TCP_LISTEN;
+		break;
+	case SO_REUSEADDR:
+		*value = sk->sk_reuse;
+		break;
+	case SO_REUSEPORT:
+		*value = sk->sk_reuseport;
+		break;
+	case SO_KEEPALIVE:
+		*value = sock_flag(sk, SOCK_KEEPOPEN);
+		break;
+	case SO_BROADCAST:
+		*value = sock_flag(sk, SOCK_BROADCAST);
+		break;
+	case SO_SNDBUF:
+		*value = READ_ONCE(sk->sk_sndbuf);
+		break;
+	case SO_RCVBUF:
+		*value = READ_ONCE(sk->sk_rcvbuf);
+		break;
+	case SO_RCVLOWAT:
+		*value = READ_ONCE(sk->sk_rcvlowat);
+		break;
+	case SO_PRIORITY:
+		*value = READ_ONCE(sk->sk_priority);
+		break;
+	case SO_MARK:
+		*value = READ_ONCE(sk->sk_mark);
+		break;
+	case SO_INCOMING_CPU:
+		*value = READ_ONCE(sk->sk_incoming_cpu);
+		break;
+#ifdef CONFIG_NET_RX_BUSY_POLL
+	case SO_BUSY_POLL:
+		*value = READ_ONCE(sk->sk_ll_usec);
+		break;
+#endif
+	default:
+		return -ENOPROTOOPT;
+	}
+	return 0;
+}
+
+static int luasocket_gettcpopt(struct sock *sk, int optname, int *value)
+{
+	struct tcp_sock *tp = tcp_sk(sk);
+
+	if (sk->sk_type != SOCK_STREAM || sk->sk_protocol != IPPROTO_TCP)
+		return -EOPNOTSUPP;
+
+	switch (optname) {
+	case TCP_NODELAY:
+		*value = !!(READ_ONCE(tp->nonagle) & TCP_NAGLE_OFF);
+		break;
+	case TCP_CORK:
+		*value = !!(READ_ONCE(tp->nonagle) & TCP_NAGLE_CORK);
+		break;
+	case TCP_KEEPIDLE:
+		*value = keepalive_time_when(tp) / HZ;
+		break;
+	case TCP_KEEPINTVL:
+		*value = keepalive_intvl_when(tp) / HZ;
+		break;
+	case TCP_KEEPCNT:
+		*value = keepalive_probes(tp);
+		break;
+	default:
+		return -ENOPROTOOPT;
+	}
+	return 0;
+}
+
+/* kernel sockets can't use getsockopt(), which copies to user memory; we read the sock instead */
+static int luasocket_getopt(lua_State *L)
+{
+	struct socket *socket = luasocket_check(L, 1);
+	int level = (int)luaL_checkinteger(L, 2);
+	int optname = (int)luaL_checkinteger(L, 3);
+	struct sock *sk = socket->sk;
+	int value = 0;
+
+	if (level == SOL_SOCKET)
+		luasocket_try(L, luasocket_getsolopt, sk, optname, &value);
+	else if (level == SOL_TCP)
+		luasocket_try(L, luasocket_gettcpopt, sk, optname, &value);
+	else if (level == SOL_IPV6 && optname == IPV6_V6ONLY)
+		value = sk->sk_ipv6only;
+	else {
+		lua_pushinteger(L, ENOPROTOOPT);
+		return lua_error(L);
+	}
+
+	lua_pushinteger(L, (lua_Integer)value);
+	return 1;
+}
+
+typedef struct luasocket_poll_s {
+	DECLARE_HASHTABLE(items, 8); /* by id */
+	struct list_head ready;
+	spinlock_t lock; /* ready */
+	struct mutex mutex; /* items */
+	wait_queue_head_t wait;
+} luasocket_poll_t;
+
+typedef struct luasocket_pollitem_s {
+	struct hlist_node node;
+	struct hlist_node socknode;
+	struct list_head ready;
+	wait_queue_entry_t wait;
+	wait_queue_head_t *whead;
+	poll_table pt;
+	luasocket_poll_t *poll;
+	lunatik_object_t *object;
+	struct socket *socket;
+	lua_Integer id;
+	__poll_t events;
+} luasocket_pollitem_t;
+
+typedef struct luasocket_pollevent_s {
+	lua_Integer id;
+	__poll_t events;
+} luasocket_pollevent_t;
+
+#define LUASOCKET_POLLMAX	(64)
+#define LUASOCKET_POLLALWAYS	(EPOLLERR | EPOLLHUP)
+
+/* items by socket, so they can be detached when sockets are closed */
+static DEFINE_HASHTABLE(luasocket_pollsockets, 8);
+static DEFINE_MUTEX(luasocket_pollmutex);
+
+static void luasocket_pollready(luasocket_pollitem_t *item, bool wake)
+{
+	luasocket_poll_t *poll = item->poll;
+	unsigned long flags;
+
+	spin_lock_irqsave(&poll->lock, flags);
+	if (list_empty(&item->ready))
+		list_add_tail(&item->ready, &poll->ready);
+	spin_unlock_irqrestore(&poll->lock, flags);
+
+	if (wake)
+		wake_up_interruptible(&poll->wait);
+}
+
+/* called by the socket wakeups (e.g., sk_data_ready and sk_write_space) */
+static int luasocket_pollwake(wait_queue_entry_t *wait, unsigned int mode, int sync, void *key)
+{
+	luasocket_pollitem_t *item = container_of(wait, luasocket_pollitem_t, wait);
+	__poll_t events = key_to_poll(key);
+
+	if (!events || (events & item->events))
+		luasocket_pollready(item, true);
+	return 0;
+}
+
+static void luasocket_pollqueue(struct file *file, wait_queue_head_t *whead, poll_table *pt)
+{
+	luasocket_pollitem_t *item = container_of(pt, luasocket_pollitem_t, pt);
+
+	if (item->whead == NULL) {
+		item->whead = whead;
+		init_waitqueue_func_entry(&item->wait, luasocket_pollwake);
+		add_wait_queue(whead, &item->wait);
+	}
+}
+
+static inline __poll_t luasocket_pollcheck(luasocket_pollitem_t *item, poll_table *pt)
+{
+	struct socket *socket = item->socket;
+	return socket->ops->poll(NULL, socket, pt) & item->events;
+}
+
+/* must hold luasocket_pollmutex and poll->mutex */
+static void luasocket_polldetach(luasocket_pollitem_t *item)
+{
+	luasocket_poll_t *poll = item->poll;
+
+	if (item->whead != NULL) {
+		remove_wait_queue(item->whead, &item->wait);
+		item->whead = NULL;
+	}
+
+	spin_lock_irq(&poll->lock);
+	list_del_init(&item->ready);
+	spin_unlock_irq(&poll->lock);
+
+	if (item->socket != NULL) {
+		hash_del(&item->socknode);
+		item->socket = NULL;
+	}
+}
+
+static void luasocket_pollclose(struct socket *socket)
+{
+	luasocket_pollitem_t *item;
+	struct hlist_node *next;
+
+	mutex_lock(&luasocket_pollmutex);
+	hash_for_each_possible_safe(luasocket_pollsockets, item, next, socknode, (unsigned long)socket) {
+		if (item->socket == socket) {
+			luasocket_poll_t *poll = item->poll;
+			mutex_lock(&poll->mutex);
+			luasocket_polldetach(item);
+			mutex_unlock(&poll->mutex);
+		}
+	}
+	mutex_unlock(&luasocket_pollmutex);
+}
+
 static void luasocket_release(void *private)
 {
 	struct socket *sock = (struct socket *)private;
+	luasocket_pollclose(sock);
 	kernel_sock_shutdown(sock, SHUT_RDWR);
 	sock_release(sock);
 }
 
+static int luasocket_poll(lua_State *L);
+
 static const luaL_Reg luasocket_lib[] = {
 	{"new", luasocket_new},
+	{"poll", luasocket_poll},
 	{NULL, NULL}
 };
 
@@ -211,12 +748,19 @@ static const luaL_Reg luasocket_mt[] = {
 	{"close", lunatik_closeobject},
 	{"send", luasocket_send},
 	{"receive", luasocket_receive},
+	{"sendfrom", luasocket_sendfrom},
+	{"receiveinto", luasocket_receiveinto},
+	{"sendmany", luasocket_sendmany},
+	{"receivemany", luasocket_receivemany},
 	{"bind", luasocket_bind},
 	{"listen", luasocket_listen},
 	{"accept", luasocket_accept},
 	{"connect", luasocket_connect},
 	{"getsockname", luasocket_getsockname},
 	{"getpeername", luasocket_getpeername},
+	{"setopt", luasocket_setopt},
+	{"sendfile", luasocket_sendfile},
+	{"getopt", luasocket_getopt},
 	{NULL, NULL}
 };
 
@@ -351,11 +895,149 @@ static const lunatik_reg_t luasocket_ipproto[] = {
 	{NULL, 0}
 };
 
+static const lunatik_reg_t luasocket_event[] = {
+	{"IN", EPOLLIN},
+	{"PRI", EPOLLPRI},
+	{"OUT", EPOLLOUT},
+	{"ERR", EPOLLERR},
+	{"HUP", EPOLLHUP},
+	{"RDNORM", EPOLLRDNORM},
+	{"RDBAND", EPOLLRDBAND},
+	{"WRNORM", EPOLLWRNORM},
+	{"WRBAND", EPOLLWRBAND},
+	{"MSG", EPOLLMSG},
+	{"RDHUP", EPOLLRDHUP},
+	{NULL, 0}
+};
+
+static const lunatik_reg_t luasocket_sol[] = {
+	{"SOCKET", SOL_SOCKET},
+	{"IP", SOL_IP},
+	{"IPV6", SOL_IPV6},
+	{"TCP", SOL_TCP},
+	{"UDP", SOL_UDP},
+	{"TLS", SOL_TLS},
+	{NULL, 0}
+};
+
+static const lunatik_reg_t luasocket_so[] = {
+	{"DEBUG", SO_DEBUG},
+	{"REUSEADDR", SO_REUSEADDR},
+	{"TYPE", SO_TYPE},
+	{"ERROR", SO_ERROR},
+	{"DONTROUTE", SO_DONTROUTE},
+	{"BROADCAST", SO_BROADCAST},
+	{"SNDBUF", SO_SNDBUF},
+	{"RCVBUF", SO_RCVBUF},
+	{"SNDBUFFORCE", SO_SNDBUFFORCE},
+	{"RCVBUFFORCE", SO_RCVBUFFORCE},
+	{"KEEPALIVE", SO_KEEPALIVE},
+	{"OOBINLINE", SO_OOBINLINE},
+	{"PRIORITY", SO_PRIORITY},
+	{"LINGER", SO_LINGER},
+	{"REUSEPORT", SO_REUSEPORT},
+	{"RCVLOWAT", SO_RCVLOWAT},
+	{"SNDLOWAT", SO_SNDLOWAT},
+	{"RCVTIMEO", SO_RCVTIMEO_NEW},
+	{"SNDTIMEO", SO_SNDTIMEO_NEW},
+	{"BINDTODEVICE", SO_BINDTODEVICE},
+	{"ACCEPTCONN", SO_ACCEPTCONN},
+	{"MARK", SO_MARK},
+	{"PROTOCOL", SO_PROTOCOL},
+	{"DOMAIN", SO_DOMAIN},
+	{"BUSY_POLL", SO_BUSY_POLL},
+	{"INCOMING_CPU", SO_INCOMING_CPU},
+	{"ZEROCOPY", SO_ZEROCOPY},
+	{NULL, 0}
+};
+
+static const lunatik_reg_t luasocket_ip[] = {
+	{"TOS", IP_TOS},
+	{"TTL", IP_TTL},
+	{"HDRINCL", IP_HDRINCL},
+	{"PKTINFO", IP_PKTINFO},
+	{"RECVERR", IP_RECVERR},
+	{"MTU_DISCOVER", IP_MTU_DISCOVER},
+	{"FREEBIND", IP_FREEBIND},
+	{"TRANSPARENT", IP_TRANSPARENT},
+	{"BIND_ADDRESS_NO_PORT", IP_BIND_ADDRESS_NO_PORT},
+	{"MULTICAST_IF", IP_MULTICAST_IF},
+	{"MULTICAST_TTL", IP_MULTICAST_TTL},
+	{"MULTICAST_LOOP", IP_MULTICAST_LOOP},
+	{"ADD_MEMBERSHIP", IP_ADD_MEMBERSHIP},
+	{"DROP_MEMBERSHIP", IP_DROP_MEMBERSHIP},
+	{NULL, 0}
+};
+
+static const lunatik_reg_t luasocket_ipv6[] = {
+	{"V6ONLY", IPV6_V6ONLY},
+	{"UNICAST_HOPS", IPV6_UNICAST_HOPS},
+	{"MULTICAST_IF", IPV6_MULTICAST_IF},
+	{"MULTICAST_HOPS", IPV6_MULTICAST_HOPS},
+	{"MULTICAST_LOOP", IPV6_MULTICAST_LOOP},
+	{"JOIN_GROUP", IPV6_ADD_MEMBERSHIP},
+	{"LEAVE_GROUP", IPV6_DROP_MEMBERSHIP},
+	{"TCLASS", IPV6_TCLASS},
+	{"RECVPKTINFO", IPV6_RECVPKTINFO},
+	{"TRANSPARENT", IPV6_TRANSPARENT},
+	{"FREEBIND", IPV6_FREEBIND},
+	{NULL, 0}
+};
+
+static const lunatik_reg_t luasocket_tcp[] = {
+	{"NODELAY", TCP_NODELAY},
+	{"MAXSEG", TCP_MAXSEG},
+	{"CORK", TCP_CORK},
+	{"KEEPIDLE", TCP_KEEPIDLE},
+	{"KEEPINTVL", TCP_KEEPINTVL},
+	{"KEEPCNT", TCP_KEEPCNT},
+	{"SYNCNT", TCP_SYNCNT},
+	{"LINGER2", TCP_LINGER2},
+	{"DEFER_ACCEPT", TCP_DEFER_ACCEPT},
+	{"WINDOW_CLAMP", TCP_WINDOW_CLAMP},
+	{"QUICKACK", TCP_QUICKACK},
+	{"CONGESTION", TCP_CONGESTION},
+	{"USER_TIMEOUT", TCP_USER_TIMEOUT},
+	{"FASTOPEN", TCP_FASTOPEN},
+	{"NOTSENT_LOWAT", TCP_NOTSENT_LOWAT},
+	{"ULP", TCP_ULP},
+	{NULL, 0}
+};
+
+static const lunatik_reg_t luasocket_udp[] = {
+	{"CORK", UDP_CORK},
+	{"ENCAP", UDP_ENCAP},
+	{"NO_CHECK6_TX", UDP_NO_CHECK6_TX},
+	{"NO_CHECK6_RX", UDP_NO_CHECK6_RX},
+	{"SEGMENT", UDP_SEGMENT},
+	{"GRO", UDP_GRO},
+	{NULL, 0}
+};
+
+static const lunatik_reg_t luasocket_tls[] = {
+	{"TX", TLS_TX},
+	{"RX", TLS_RX},
+	{"VERSION_1_2", TLS_1_2_VERSION},
+	{"VERSION_1_3", TLS_1_3_VERSION},
+	{"CIPHER_AES_GCM_128", TLS_CIPHER_AES_GCM_128},
+	{"CIPHER_AES_GCM_256", TLS_CIPHER_AES_GCM_256},
+	{"CIPHER_CHACHA20_POLY1305", TLS_CIPHER_CHACHA20_POLY1305},
+	{NULL, 0}
+};
+
 static const lunatik_namespace_t luasocket_flags[] = {
 	{"af", luasocket_af},
 	{"msg", luasocket_msg},
 	{"sock", luasocket_sock},
 	{"ipproto", luasocket_ipproto},
+	{"event", luasocket_event},
+	{"sol", luasocket_sol},
+	{"so", luasocket_so},
+	{"ip", luasocket_ip},
+	{"ipv6", luasocket_ipv6},
+	{"tcp", luasocket_tcp},
+	{"udp", luasocket_udp},
+	{"tls", luasocket_tls},
 	{NULL, NULL}
 };
 
@@ -386,12 +1068,242 @@ static int luasocket_new(lua_State *L)
 	int type = luaL_checkinteger(L, 2);
 	int proto = luaL_checkinteger(L, 3);
 	lunatik_object_t *object = luasocket_newsocket(L);
+	struct socket **psocket = luasocket_psocket(object);
 
-	luasocket_try(L, sock_create, family, type, proto, luasocket_psocket(object));
+	luasocket_try(L, sock_create, family, type & SOCK_TYPE_MASK, proto, psocket);
+	if (type & SOCK_NONBLOCK) { /* kernel sockets have no file; zero timeouts make them fail with EAGAIN */
+		struct sock *sk = (*psocket)->sk;
+		sk->sk_rcvtimeo = 0;
+		sk->sk_sndtimeo = 0;
+	}
 	return 1; /* object */
 }
 
-LUNATIK_NEWLIB(socket, luasocket_lib, &luasocket_class, luasocket_flags);
+static luasocket_pollitem_t *luasocket_pollfind(luasocket_poll_t *poll, lua_Integer id)
+{
+	luasocket_pollitem_t *item;
+
+	hash_for_each_possible(poll->items, item, node, (unsigned long)id)
+		if (item->id == id)
+			return item;
+	return NULL;
+}
+
+LUNATIK_OBJECTCHECKER(luasocket_checkpoll, luasocket_poll_t *);
+
+static int luasocket_polladd(lua_State *L)
+{
+	luasocket_poll_t *poll = luasocket_checkpoll(L, 1);
+	lunatik_object_t *object = lunatik_checkobject(L, 2);
+	struct socket *socket = (struct socket *)object->private;
+	lua_Integer id = luaL_checkinteger(L, 3);
+	__poll_t events = (__poll_t)luaL_optinteger(L, 4, EPOLLIN);
+	luasocket_pollitem_t *item;
+
+	luaL_argcheck(L, object->class == &luasocket_class, 2, "socket expected");
+	lunatik_argchecknull(L, socket, 2);
+
+	if ((item = (luasocket_pollitem_t *)kzalloc(sizeof(luasocket_pollitem_t), GFP_KERNEL)) == NULL)
+		luaL_error(L, "out of memory");
+
+	item->poll = poll;
+	item->object = object;
+	item->socket = socket;
+	item->id = id;
+	item->events = events | LUASOCKET_POLLALWAYS;
+	INIT_LIST_HEAD(&item->ready);
+	init_poll_funcptr(&item->pt, luasocket_pollqueue);
+	item->pt._key = item->events;
+
+	mutex_lock(&luasocket_pollmutex);
+	mutex_lock(&poll->mutex);
+	if (luasocket_pollfind(poll, id) != NULL) {
+		mutex_unlock(&poll->mutex);
+		mutex_unlock(&luasocket_pollmutex);
+		kfree(item);
+		return luaL_argerror(L, 3, "id already in use");
+	}
+
+	lunatik_getobject(object);
+	hash_add(poll->items, &item->node, (unsigned long)id);
+	hash_add(luasocket_pollsockets, &item->socknode, (unsigned long)socket);
+
+	if (luasocket_pollcheck(item, &item->pt))
+		luasocket_pollready(item, true);
+	mutex_unlock(&poll->mutex);
+	mutex_unlock(&luasocket_pollmutex);
+	return 0;
+}
+
+static int luasocket_pollmodify(lua_State *L)
+{
+	luasocket_poll_t *poll = luasocket_checkpoll(L, 1);
+	lua_Integer id = luaL_checkinteger(L, 2);
+	__poll_t events = (__poll_t)luaL_checkinteger(L, 3);
+	luasocket_pollitem_t *item;
+
+	mutex_lock(&poll->mutex);
+	if ((item = luasocket_pollfind(poll, id)) != NULL) {
+		item->events = events | LUASOCKET_POLLALWAYS;
+		if (item->socket != NULL && luasocket_pollcheck(item, NULL))
+			luasocket_pollready(item, true);
+	}
+	mutex_unlock(&poll->mutex);
+
+	luaL_argcheck(L, item != NULL, 2, "id not found");
+	return 0;
+}
+
+static int luasocket_pollremove(lua_State *L)
+{
+	luasocket_poll_t *poll = luasocket_checkpoll(L, 1);
+	lua_Integer id = luaL_checkinteger(L, 2);
+	luasocket_pollitem_t *item;
+
+	mutex_lock(&luasocket_pollmutex);
+	mutex_lock(&poll->mutex);
+	if ((item = luasocket_pollfind(poll, id)) != NULL) {
+		luasocket_polldetach(item);
+		hash_del(&item->node);
+	}
+	mutex_unlock(&poll->mutex);
+	mutex_unlock(&luasocket_pollmutex);
+
+	luaL_argcheck(L, item != NULL, 2, "id not found");
+	lunatik_putobject(item->object); /* might release the socket */
+	kfree(item);
+	return 0;
+}
+
+static int luasocket_pollcollect(luasocket_poll_t *poll, luasocket_pollevent_t *events, int max)
+{
+	luasocket_pollitem_t *item, *next;
+	LIST_HEAD(ready);
+	int n = 0;
+
+	mutex_lock(&poll->mutex);
+	spin_lock_irq(&poll->lock);
+	list_splice_init(&poll->ready, &ready);
+	spin_unlock_irq(&poll->lock);
+
+	list_for_each_entry_safe(item, next, &ready, ready) {
+		__poll_t mask;
+
+		if (n == max)
+			break;
+
+		list_del_init(&item->ready);
+		if (item->socket == NULL || (mask = luasocket_pollcheck(item, NULL)) == 0)
+			continue;
+
+		events[n].id = item->id;
+		events[n++].events = mask;
+		luasocket_pollready(item, false); /* level-triggered */
+	}
+
+	spin_lock_irq(&poll->lock);
+	list_splice(&ready, &poll->ready); /* not collected */
+	spin_unlock_irq(&poll->lock);
+	mutex_unlock(&poll->mutex);
+	return n;
+}
+
+#define luasocket_pollstop()	((current->flags & PF_KTHREAD) && kthread_should_stop())
+#define luasocket_pollisready(poll)	(!list_empty_careful(&(poll)->ready) || luasocket_pollstop())
+
+static int luasocket_pollwait(lua_State *L)
+{
+	luasocket_poll_t *poll = luasocket_checkpoll(L, 1);
+	lua_Integer msecs = luaL_optinteger(L, 2, -1);
+	lua_Integer max = luaL_optinteger(L, 3, LUASOCKET_POLLMAX);
+	long timeout = msecs < 0 ? MAX_SCHEDULE_TIMEOUT : (long)msecs_to_jiffies((unsigned int)min_t(lua_Integer, msecs, UINT_MAX));
+	luasocket_pollevent_t *events;
+	int i, n;
+
+	luaL_argcheck(L, max > 0 && max <= UIO_MAXIOV, 3, "invalid number of events");
+	events = (luasocket_pollevent_t *)lua_newuserdatauv(L, sizeof(luasocket_pollevent_t) * max, 0);
+
+	while ((n = luasocket_pollcollect(poll, events, (int)max)) == 0 && timeout > 0 && !luasocket_pollstop())
+		if ((timeout = wait_event_interruptible_timeout(poll->wait, luasocket_pollisready(poll), timeout)) < 0)
+			break;
+
+	lua_createtable(L, 0, n);
+	for (i = 0; i < n; i++) {
+		lua_pushinteger(L, (lua_Integer)events[i].events);
+		lua_seti(L, -2, events[i].id);
+	}
+	return 1; /* events */
+}
+
+static void luasocket_pollrelease(void *private)
+{
+	luasocket_poll_t *poll = (luasocket_poll_t *)private;
+	luasocket_pollitem_t *item;
+	struct hlist_node *next;
+	LIST_HEAD(items);
+	int bkt;
+
+	mutex_lock(&luasocket_pollmutex);
+	mutex_lock(&poll->mutex);
+	hash_for_each_safe(poll->items, bkt, next, item, node) {
+		luasocket_polldetach(item);
+		hash_del(&item->node);
+		list_add(&item->ready, &items);
+	}
+	mutex_unlock(&poll->mutex);
+	mutex_unlock(&luasocket_pollmutex);
+
+	while (!list_empty(&items)) {
+		item = list_first_entry(&items, luasocket_pollitem_t, ready);
+		list_del(&item->ready);
+		lunatik_putobject(item->object);
+		kfree(item);
+	}
+	mutex_destroy(&poll->mutex);
+}
+
+static const luaL_Reg luasocket_poll_mt[] = {
+	{"__gc", lunatik_deleteobject},
+	{"__close", lunatik_closeobject},
+	{"close", lunatik_closeobject},
+	{"add", luasocket_polladd},
+	{"modify", luasocket_pollmodify},
+	{"remove", luasocket_pollremove},
+	{"wait", luasocket_pollwait},
+	{NULL, NULL}
+};
+
+static const lunatik_class_t luasocket_poll_class = {
+	.name = "socket.poll",
+	.methods = luasocket_poll_mt,
+	.release = luasocket_pollrelease,
+	.sleep = true,
+};
+
+static int luasocket_poll(lua_State *L)
+{
+	lunatik_object_t *object = lunatik_newobject(L, &luasocket_poll_class, sizeof(luasocket_poll_t));
+	luasocket_poll_t *poll = (luasocket_poll_t *)object->private;
+
+	hash_init(poll->items);
+	INIT_LIST_HEAD(&poll->ready);
+	spin_lock_init(&poll->lock);
+	mutex_init(&poll->mutex);
+	init_waitqueue_head(&poll->wait);
+	return 1; /* object */
+}
+
+int luaopen_socket(lua_State *L);
+int luaopen_socket(lua_State *L)
+{
+	luaL_newlib(L, luasocket_lib);
+	lunatik_checkclass(L, &luasocket_class);
+	lunatik_newclass(L, &luasocket_class);
+	lunatik_newclass(L, &luasocket_poll_class);
+	lunatik_newnamespaces(L, luasocket_flags);
+	return 1;
+}
+EXPORT_SYMBOL_GPL(luaopen_socket);
 
 static int __init luasocket_init(void)
 {
@@ -6,7 +6,14 @@
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/version.h>
 #include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/cpumask.h>
+#include <linux/cpu.h>
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5, 9, 0)) && (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0))
+#include <uapi/linux/sched/types.h>
+#endif
 
 #include <lua.h>
 #include <lualib.h>
@@ -17,15 +24,31 @@
 typedef struct luathread_s {
 	struct task_struct *task;
 	lunatik_object_t *runtime;
+	int cpu; /* bound cpu or -1 */
 } luathread_t;
 
+typedef struct luathread_attr_s {
+	int cpu;
+	int policy;
+	int nice;
+} luathread_attr_t;
+
 static int luathread_run(lua_State *L);
+static int luathread_percpu(lua_State *L);
+static int luathread_cpus(lua_State *L);
 static int luathread_current(lua_State *L);
 
 static int luathread_resume(lua_State *L, luathread_t *thread)
 {
-	int nresults;
-	int status = lua_resume(L, NULL, 0, &nresults);
+	int nresults, nargs = 0;
+	int status;
+
+	if (thread->cpu >= 0) {
+		lua_pushinteger(L, thread->cpu);
+		nargs = 1;
+	}
+
+	status = lua_resume(L, NULL, nargs, &nresults);
 	if (status != LUA_OK && status != LUA_YIELD) {
 		pr_err("[%p] %s\n", thread, lua_tostring(L, -1));
 		lua_pop(L, 1);
@@ -116,6 +139,8 @@ static int luathread_task(lua_State *L)
 
 static const luaL_Reg luathread_lib[] = {
 	{"run", luathread_run},
+	{"percpu", luathread_percpu},
+	{"cpus", luathread_cpus},
 	{"shouldstop", luathread_shouldstop},
 	{"current", luathread_current},
 	{NULL, NULL}
@@ -137,25 +162,183 @@ static const lunatik_class_t luathread_class = {
 
 #define luathread_new(L)	(lunatik_newobject((L), &luathread_class, sizeof(luathread_t)))
 
+static lua_Integer luathread_optfield(lua_State *L, int ix, const char *field, lua_Integer def)
+{
+	lua_Integer value = def;
+	int type = lua_getfield(L, ix, field);
+
+	if (type != LUA_TNIL) {
+		if (!lua_isinteger(L, -1))
+			luaL_error(L, "bad field '%s' (integer expected, got %s)", field, lua_typename(L, type));
+		value = lua_tointeger(L, -1);
+	}
+	lua_pop(L, 1);
+	return value;
+}
+
+static void luathread_checkattr(lua_State *L, int ix, luathread_attr_t *attr)
+{
+	lua_Integer cpu, policy, nice;
+
+	attr->cpu = -1;
+	attr->policy = SCHED_NORMAL;
+	attr->nice = 0;
+	if (lua_isnoneornil(L, ix))
+		return;
+
+	luaL_checktype(L, ix, LUA_TTABLE);
+	cpu = luathread_optfield(L, ix, "cpu", -1);
+	policy = luathread_optfield(L, ix, "policy", SCHED_NORMAL);
+	nice = luathread_optfield(L, ix, "nice", 0);
+
+	luaL_argcheck(L, cpu < 0 || (cpu < nr_cpu_ids && cpu_online(cpu)), ix, "invalid cpu");
+	luaL_argcheck(L, policy == SCHED_NORMAL || policy == SCHED_FIFO, ix, "invalid policy");
+	luaL_argcheck(L, nice >= MIN_NICE && nice <= MAX_NICE, ix, "invalid nice");
+	attr->cpu = (int)cpu;
+	attr->policy = (int)policy;
+	attr->nice = (int)nice;
+}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0))
+#define luathread_setfifo(task)		sched_set_fifo(task)
+#define luathread_setnormal(task, nice)	sched_set_normal((task), (nice))
+#else
+static inline void luathread_setfifo(struct task_struct *task)
+{
+	struct sched_param param = {.sched_priority = MAX_RT_PRIO / 2}; /* as sched_set_fifo() */
+	sched_setscheduler_nocheck(task, SCHED_FIFO, &param);
+}
+
+/* new kthreads are already SCHED_NORMAL */
+#define luathread_setnormal(task, nice)	set_user_nice((task), (nice))
+#endif
+
+/* takes the caller's reference to runtime; pushes the new thread object */
+static struct task_struct *luathread_spawn(lua_State *L, lunatik_object_t *runtime, const char *name,
+	const luathread_attr_t *attr)
+{
+	lunatik_object_t *object = luathread_new(L);
+	luathread_t *thread = (luathread_t *)object->private;
+	int node = attr->cpu >= 0 ? cpu_to_node(attr->cpu) : NUMA_NO_NODE;
+	struct task_struct *task = kthread_create_on_node(luathread_func, object, node, "%s", name);
+
+	if (IS_ERR(task)) {
+		lunatik_putobject(runtime);
+		return task;
+	}
+
+	lunatik_getobject(object);
+	thread->runtime = runtime;
+	thread->task = task;
+	thread->cpu = attr->cpu;
+
+	if (attr->cpu >= 0)
+		kthread_bind(task, (unsigned int)attr->cpu);
+	if (attr->policy == SCHED_FIFO)
+		luathread_setfifo(task);
+	else
+		luathread_setnormal(task, attr->nice);
+	wake_up_process(task);
+	return task;
+}
+
 static int luathread_run(lua_State *L)
 {
 	lunatik_object_t *runtime = lunatik_checkobject(L, 1);
 	luaL_argcheck(L, runtime->sleep, 1, "cannot use non-sleepable runtime in this context");
 	const char *name = luaL_checkstring(L, 2);
-	lunatik_object_t *object = luathread_new(L);
-	luathread_t *thread = object->private;
+	luathread_attr_t attr;
 
-	lunatik_getobject(object);
+	luathread_checkattr(L, 3, &attr);
 	lunatik_getobject(runtime);
-	thread->runtime = runtime;
-
-	thread->task = kthread_run(luathread_func, object, name);
-	if (IS_ERR(thread->task))
+	if (IS_ERR(luathread_spawn(L, runtime, name, &attr)))
 		luaL_error(L, "failed to create a new thread");
-
 	return 1; /* object */
 }
 
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(4, 13, 0))
+#define cpus_read_lock()	get_online_cpus()
+#define cpus_read_unlock()	put_online_cpus()
+#endif
+
+/* stack: threads, script, name, attr */
+static int luathread_spawnpercpu(lua_State *L)
+{
+	const char *script = lua_tostring(L, 2);
+	const char *name = lua_tostring(L, 3);
+	luathread_attr_t *attr = (luathread_attr_t *)lua_touserdata(L, 4);
+	lua_Integer i = 1;
+	int cpu;
+
+	for_each_online_cpu(cpu) {
+		lunatik_object_t *runtime;
+		const char *cpuname = lua_pushfstring(L, "%s/%d", name, cpu);
+
+		if (lunatik_runtime(&runtime, script, true) != 0)
+			luaL_error(L, "failed to create runtime for '%s'", script);
+
+		attr->cpu = cpu;
+		if (IS_ERR(luathread_spawn(L, runtime, cpuname, attr)))
+			luaL_error(L, "failed to create a new thread");
+		lua_rawseti(L, 1, i++);
+		lua_pop(L, 1); /* cpuname */
+	}
+	return 0;
+}
+
+static void luathread_stopall(lua_State *L, int ix)
+{
+	lua_pushnil(L);
+	while (lua_next(L, ix) != 0) {
+		lua_getfield(L, -1, "stop");
+		lua_insert(L, -2); /* stack: key, stop, thread */
+		lua_call(L, 1, 0);
+	}
+}
+
+static int luathread_percpu(lua_State *L)
+{
+	const char *script = luaL_checkstring(L, 1);
+	const char *name = luaL_checkstring(L, 2);
+	luathread_attr_t attr;
+	int threads, status;
+
+	luathread_checkattr(L, 3, &attr);
+	luaL_argcheck(L, attr.cpu < 0, 3, "cpu can't be set on percpu threads");
+
+	lua_newtable(L);
+	threads = lua_gettop(L);
+	lua_pushcfunction(L, luathread_spawnpercpu);
+	lua_pushvalue(L, threads);
+	lua_pushstring(L, script);
+	lua_pushstring(L, name);
+	lua_pushlightuserdata(L, &attr);
+
+	/* CPUs can't go offline before their threads are bound; errors are caught to release the lock */
+	cpus_read_lock();
+	status = lua_pcall(L, 4, 0, 0);
+	cpus_read_unlock();
+
+	if (status != LUA_OK) { /* threads hold their own references, thus we stop them */
+		luathread_stopall(L, threads);
+		return lua_error(L);
+	}
+	return 1; /* threads */
+}
+
+static int luathread_cpus(lua_State *L)
+{
+	lua_Integer i = 1;
+	int cpu;
+
+	lua_createtable(L, num_online_cpus(), 0);
+	for_each_online_cpu(cpu) {
+		lua_pushinteger(L, cpu);
+		lua_rawseti(L, -2, i++);
+	}
+	return 1; /* cpus */
+}
+
 static int luathread_current(lua_State *L)
 {
 	lunatik_object_t *object = luathread_new(L);
@@ -163,10 +346,22 @@ static int luathread_current(lua_State *L)
 
 	thread->runtime = NULL;
 	thread->task = current;
+	thread->cpu = -1;
 	return 1; /* object */
 }
 
-LUNATIK_NEWLIB(thread, luathread_lib, &luathread_class, NULL);
+static const lunatik_reg_t luathread_sched[] = {
+	{"NORMAL", SCHED_NORMAL},
+	{"FIFO", SCHED_FIFO},
+	{NULL, 0}
+};
+
+static const lunatik_namespace_t luathread_flags[] = {
+	{"sched", luathread_sched},
+	{NULL, NULL}
+};
+
+LUNATIK_NEWLIB(thread, luathread_lib, &luathread_class, luathread_flags);
 
 static int __init luathread_init(void)
 {
@@ -0,0 +1,319 @@
+/*
+* SPDX-FileCopyrightText: (c) 2024 Ring Zero Desenvolvimento de Software LTDA
+* SPDX-License-Identifier: MIT OR GPL-2.0-only
+*/
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include <linux/atomic.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include <lunatik.h>
+
+#define LUAWORKQUEUE_MAXARGS	(LUA_MINSTACK)
+
+typedef struct luaworkqueue_s {
+	struct workqueue_struct *wq;
+	lunatik_object_t *runtime;
+	struct work_struct destroy;
+	atomic_t pending;
+	int max;
+} luaworkqueue_t;
+
+static struct workqueue_struct *luaworkqueue_reaper;
+
+typedef struct luaworkqueue_arg_s {
+	int type;
+	union {
+		lua_Integer integer;
+		int boolean;
+		lunatik_object_t *object;
+		struct {
+			const char *str;
+			size_t len;
+		};
+	};
+} luaworkqueue_arg_t;
+
+typedef struct luaworkqueue_work_s {
+	struct work_struct work;
+	luaworkqueue_t *queue;
+	const char *name;
+	int nargs;
+	luaworkqueue_arg_t args[];
+	/* strings are stored after args */
+} luaworkqueue_work_t;
+
+static int luaworkqueue_new(lua_State *L);
+
+LUNATIK_OBJECTCHECKER(luaworkqueue_check, luaworkqueue_t *);
+
+static int luaworkqueue_dispatch(lua_State *L)
+{
+	luaworkqueue_work_t *work = (luaworkqueue_work_t *)lua_touserdata(L, 1);
+	int i;
+
+	if (lua_getglobal(L, work->name) != LUA_TFUNCTION)
+		return luaL_error(L, "'%s' is not a function", work->name);
+
+	luaL_checkstack(L, work->nargs, NULL);
+	for (i = 0; i < work->nargs; i++) {
+		luaworkqueue_arg_t *arg = &work->args[i];
+		switch (arg->type) {
+		case LUA_TBOOLEAN:
+			lua_pushboolean(L, arg->boolean);
+			break;
+		case LUA_TNUMBER:
+			lua_pushinteger(L, arg->integer);
+			break;
+		case LUA_TSTRING:
+			lua_pushlstring(L, arg->str, arg->len);
+			break;
+		case LUA_TUSERDATA:
+			lunatik_pushobject(L, arg->object);
+			break;
+		default:
+			lua_pushnil(L);
+			break;
+		}
+	}
+	lua_call(L, work->nargs, 0);
+	return 0;
+}
+
+static int luaworkqueue_handler(lua_State *L, luaworkqueue_work_t *work)
+{
+	lua_pushcfunction(L, luaworkqueue_dispatch);
+	lua_pushlightuserdata(L, work);
+	if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+		pr_err("%s: %s\n", work->name, lua_tostring(L, -1));
+		return -ENOEXEC;
+	}
+	return 0;
+}
+
+static void luaworkqueue_free(luaworkqueue_work_t *work)
+{
+	int i;
+
+	for (i = 0; i < work->nargs; i++)
+		if (work->args[i].type == LUA_TUSERDATA)
+			lunatik_putobject(work->args[i].object);
+	kfree(work);
+}
+
+static void luaworkqueue_func(struct work_struct *w)
+{
+	luaworkqueue_work_t *work = container_of(w, luaworkqueue_work_t, work);
+	luaworkqueue_t *queue = work->queue;
+	int ret;
+
+	lunatik_run(queue->runtime, luaworkqueue_handler, ret, work);
+	atomic_dec(&queue->pending);
+	luaworkqueue_free(work);
+}
+
+static size_t luaworkqueue_checkargs(lua_State *L, int ix, int nargs)
+{
+	size_t size = 0;
+	int i;
+
+	luaL_argcheck(L, nargs <= LUAWORKQUEUE_MAXARGS, ix + LUAWORKQUEUE_MAXARGS, "too many arguments");
+	for (i = ix; i < ix + nargs; i++) {
+		switch (lua_type(L, i)) {
+		case LUA_TNIL: case LUA_TBOOLEAN:
+			break;
+		case LUA_TNUMBER:
+			luaL_argcheck(L, lua_isinteger(L, i), i, "integer expected");
+			break;
+		case LUA_TSTRING:
+			size += lua_rawlen(L, i);
+			break;
+		default:
+			luaL_argcheck(L, lunatik_testobject(L, i) != NULL, i, "nil, boolean, integer, string or object expected");
+			break;
+		}
+	}
+	return size;
+}
+
+static void luaworkqueue_setargs(lua_State *L, int ix, luaworkqueue_work_t *work, char *buffer)
+{
+	int i;
+
+	for (i = 0; i < work->nargs; i++) {
+		luaworkqueue_arg_t *arg = &work->args[i];
+		int type = lua_type(L, ix + i);
+
+		arg->type = type;
+		switch (type) {
+		case LUA_TBOOLEAN:
+			arg->boolean = lua_toboolean(L, ix + i);
+			break;
+		case LUA_TNUMBER:
+			arg->integer = lua_tointeger(L, ix + i);
+			break;
+		case LUA_TSTRING: {
+			const char *str = lua_tolstring(L, ix + i, &arg->len);
+			memcpy(buffer, str, arg->len);
+			arg->str = buffer;
+			buffer += arg->len;
+			break;
+		}
+		case LUA_TUSERDATA:
+			arg->object = lunatik_testobject(L, ix + i);
+			lunatik_getobject(arg->object);
+			break;
+		}
+	}
+}
+
+static int luaworkqueue_queue(lua_State *L)
+{
+	luaworkqueue_t *queue = luaworkqueue_check(L, 1);
+	size_t namelen;
+	const char *name = luaL_checklstring(L, 2, &namelen);
+	int nargs = lua_gettop(L) - 2;
+	size_t size = luaworkqueue_checkargs(L, 3, nargs);
+	luaworkqueue_work_t *work;
+	char *buffer;
+
+	if (atomic_inc_return(&queue->pending) > queue->max) {
+		atomic_dec(&queue->pending);
+		lua_pushboolean(L, false);
+		return 1;
+	}
+
+	size += namelen + 1;
+	work = kmalloc(struct_size(work, args, nargs) + size, lunatik_gfp(lunatik_toruntime(L)));
+	if (work == NULL) {
+		atomic_dec(&queue->pending);
+		return luaL_error(L, "not enough memory");
+	}
+
+	buffer = (char *)&work->args[nargs];
+	memcpy(buffer, name, namelen + 1);
+	work->name = buffer;
+	work->queue = queue;
+	work->nargs = nargs;
+	luaworkqueue_setargs(L, 3, work, buffer + namelen + 1);
+
+	INIT_WORK(&work->work, luaworkqueue_func);
+	queue_work(queue->wq, &work->work);
+	lua_pushboolean(L, true);
+	return 1;
+}
+
+static int luaworkqueue_pending(lua_State *L)
+{
+	luaworkqueue_t *queue = luaworkqueue_check(L, 1);
+	lua_pushinteger(L, (lua_Integer)atomic_read(&queue->pending));
+	return 1;
+}
+
+static int luaworkqueue_flush(lua_State *L)
+{
+	luaworkqueue_t *queue = luaworkqueue_check(L, 1);
+
+	lunatik_checkruntime(L, true);
+	luaL_argcheck(L, lunatik_toruntime(L) != queue->runtime, 1, "cannot flush from the target runtime");
+	flush_workqueue(queue->wq);
+	return 0;
+}
+
+static void luaworkqueue_destroy(struct work_struct *work)
+{
+	luaworkqueue_t *queue = container_of(work, luaworkqueue_t, destroy);
+
+	destroy_workqueue(queue->wq); /* drains pending works */
+	lunatik_putobject(queue->runtime);
+	kfree(queue);
+}
+
+/*
+* pending works lock the target runtime, which might be the one releasing us;
+* thus, we defer draining them to avoid deadlocks (and sleeping in atomic context)
+*/
+static void luaworkqueue_release(void *private)
+{
+	luaworkqueue_t *queue = (luaworkqueue_t *)private;
+
+	INIT_WORK(&queue->destroy, luaworkqueue_destroy);
+	queue_work(luaworkqueue_reaper, &queue->destroy);
+}
+
+static const luaL_Reg luaworkqueue_lib[] = {
+	{"new", luaworkqueue_new},
+	{NULL, NULL}
+};
+
+static const luaL_Reg luaworkqueue_mt[] = {
+	{"__gc", lunatik_deleteobject},
+	{"__close", lunatik_closeobject},
+	{"__len", luaworkqueue_pending},
+	{"close", lunatik_closeobject},
+	{"queue", luaworkqueue_queue},
+	{"flush", luaworkqueue_flush},
+	{NULL, NULL}
+};
+
+static const lunatik_class_t luaworkqueue_class = {
+	.name = "workqueue",
+	.methods = luaworkqueue_mt,
+	.release = luaworkqueue_release,
+	.sleep = false,
+	.pointer = true,
+};
+
+static int luaworkqueue_new(lua_State *L)
+{
+	lunatik_object_t *runtime = lunatik_checkobject(L, 1);
+	const char *name = luaL_checkstring(L, 2);
+	lua_Integer max = luaL_optinteger(L, 3, 1024);
+	unsigned int flags = lua_toboolean(L, 4) ? WQ_UNBOUND : 0;
+	lunatik_object_t *object;
+	luaworkqueue_t *queue;
+
+	luaL_argcheck(L, runtime->sleep, 1, "cannot use non-sleepable runtime in this context");
+	luaL_argcheck(L, max > 0 && max <= INT_MAX, 3, "invalid size");
+	lunatik_checkruntime(L, true);
+
+	object = lunatik_newobject(L, &luaworkqueue_class, 0);
+	queue = (luaworkqueue_t *)lunatik_checkalloc(L, sizeof(luaworkqueue_t));
+
+	if ((queue->wq = alloc_workqueue("%s", flags, 0, name)) == NULL) {
+		lunatik_free(queue);
+		luaL_error(L, "failed to allocate workqueue");
+	}
+
+	lunatik_getobject(runtime);
+	queue->runtime = runtime;
+	queue->max = (int)max;
+	atomic_set(&queue->pending, 0);
+	object->private = queue;
+	return 1; /* object */
+}
+
+LUNATIK_NEWLIB(workqueue, luaworkqueue_lib, &luaworkqueue_class, NULL);
+
+static int __init luaworkqueue_init(void)
+{
+	luaworkqueue_reaper = alloc_workqueue("luaworkqueue", WQ_UNBOUND, 0);
+	return luaworkqueue_reaper == NULL ? -ENOMEM : 0;
+}
+
+static void __exit luaworkqueue_exit(void)
+{
+	destroy_workqueue(luaworkqueue_reaper);
+}
+
+module_init(luaworkqueue_init);
+module_exit(luaworkqueue_exit);
+MODULE_LICENSE("Dual MIT/GPL");
+MODULE_AUTHOR("Lourival Vieira Neto <lourival.neto@ring-0.io>");
+
@@ -23,9 +23,17 @@ typedef enum luaxtable_type_e {
 	LUAXTABLE_TTARGET,
 } luaxtable_type_t;
 
+typedef enum luaxtable_op_e {
+	LUAXTABLE_OCHECKENTRY,
+	LUAXTABLE_ODESTROY,
+	LUAXTABLE_OHOOK,
+	LUAXTABLE_NOPS,
+} luaxtable_op_t;
+
 typedef struct luaxtable_s {
 	lunatik_object_t *runtime;
 	lunatik_object_t *skb;
+	int ops[LUAXTABLE_NOPS]; /* handler references */
 	union {
 		struct xt_match match;
 		struct xt_target target;
@@ -40,26 +48,26 @@ static struct {
 	unsigned int target_fallback;
 } luaxtable_hooks = {NULL, NULL, false, XT_CONTINUE};
 
-static int luaxtable_docall(lua_State *L, luaxtable_t *xtable, luaxtable_info_t *info, const char *op, int nargs, int nret)
+static inline const char *luaxtable_opname(luaxtable_t *xtable, luaxtable_op_t op)
 {
-	int base = lua_gettop(L) - nargs;
+	static const char *names[] = {"checkentry", "destroy"};
+	return op != LUAXTABLE_OHOOK ? names[op] : xtable->type == LUAXTABLE_TMATCH ? "match" : "target";
+}
 
-	if (lunatik_getregistry(L, xtable) != LUA_TTABLE) {
-		pr_err("%s: could not find ops table\n", op);
-		goto err;
-	}
+static int luaxtable_docall(lua_State *L, luaxtable_t *xtable, luaxtable_info_t *info, luaxtable_op_t op, int nargs, int nret)
+{
+	int base = lua_gettop(L) - nargs;
 
-	if (lua_getfield(L, -1, op) != LUA_TFUNCTION) {
-		pr_err("%s isn't defined\n", op);
+	if (lunatik_getref(L, xtable->ops[op]) != LUA_TFUNCTION) {
+		pr_err("%s isn't defined\n", luaxtable_opname(xtable, op));
 		goto err;
 	}
 
 	lua_insert(L, base + 1); /* op */
-	lua_pop(L, 1); /* table */
 	lua_pushlstring(L, info->userargs, LUAXTABLE_USERDATA_SIZE); /* userargs */
 
 	if (lua_pcall(L, nargs + 1, nret, 0) != LUA_OK) {
-		pr_err("%s error: %s\n", op, lua_tostring(L, -1));
+		pr_err("%s error: %s\n", luaxtable_opname(xtable, op), lua_tostring(L, -1));
 		goto err;
 	}
 	return 0;
@@ -82,7 +90,7 @@ static int luaxtable_pushparams(lua_State *L, const struct xt_action_param *par,
 		pr_err("could not get skb\n");
 		return -1;
 	}
-        luadata_reset(data, skb->data, skb->len, opt);
+	luadata_resetskb(data, skb, opt); /* linear, thus skb->len bytes as before */
 
 	lua_newtable(L);
 	lua_pushboolean(L, par->hotdrop);
@@ -102,12 +110,12 @@ static int luaxtable_pushparams(lua_State *L, const struct xt_action_param *par,
 	return 0;
 }
 
-#define luaxtable_call(L, op, xtable, skb, par, info, opt)	\
-	((luaxtable_pushparams(L, par, xtable, skb, opt) == -1) || (luaxtable_docall(L, xtable, info, op, 2, 1) == -1))
+#define luaxtable_call(L, xtable, skb, par, info, opt)	\
+	((luaxtable_pushparams(L, par, xtable, skb, opt) == -1) || (luaxtable_docall(L, xtable, info, LUAXTABLE_OHOOK, 2, 1) == -1))
 
 static int luaxtable_domatch(lua_State *L, luaxtable_t *xtable, const struct sk_buff *skb, struct xt_action_param *par, int fallback)
 {
-	if (luaxtable_call(L, "match", xtable, (struct sk_buff *)skb, par, (luaxtable_info_t *)par->matchinfo, LUADATA_OPT_READONLY) != 0)
+	if (luaxtable_call(L, xtable, (struct sk_buff *)skb, par, (luaxtable_info_t *)par->matchinfo, LUADATA_OPT_READONLY) != 0)
 		return fallback;
 
 	int ret = lua_toboolean(L, -1);
@@ -118,7 +126,7 @@ static int luaxtable_domatch(lua_State *L, luaxtable_t *xtable, const struct sk_
 
 static int luaxtable_dotarget(lua_State *L, luaxtable_t *xtable, struct sk_buff *skb, const struct xt_action_param *par, int fallback)
 {
-	if (luaxtable_call(L, "target", xtable,  skb, par, (luaxtable_info_t *)par->targinfo, LUADATA_OPT_NONE) != 0)
+	if (luaxtable_call(L, xtable, skb, par, (luaxtable_info_t *)par->targinfo, LUADATA_OPT_NONE) != 0)
 		return fallback;
 
 	int ret = lua_tointeger(L, -1);
@@ -150,7 +158,7 @@ static int luaxtable_##hook##_check(const struct xt_##hk##chk_param *par)	\
 	luaxtable_info_t *info = (luaxtable_info_t *)par->huk##info; 		\
 	info->data = xtable;							\
 										\
-	lunatik_run(xtable->runtime, luaxtable_docall, ret, xtable, info, "checkentry", 0, 1);	\
+	lunatik_run(xtable->runtime, luaxtable_docall, ret, xtable, info, LUAXTABLE_OCHECKENTRY, 0, 1);	\
 	return ret != 0 ? -EINVAL : 0;						\
 }
 
@@ -161,7 +169,7 @@ static void luaxtable_##hook##_destroy(const struct xt_##hk##dtor_param *par)	\
 	luaxtable_info_t *info = (luaxtable_info_t *)par->huk##info; 		\
 	luaxtable_t *xtable = (luaxtable_t *)info->data;			\
 										\
-	lunatik_run(xtable->runtime, luaxtable_docall, ret, xtable, info, "destroy", 0, 0);	\
+	lunatik_run(xtable->runtime, luaxtable_docall, ret, xtable, info, LUAXTABLE_ODESTROY, 0, 0);	\
 }
 
 LUAXTABLE_HOOK_CB(match, match, const struct  sk_buff *, struct xt_action_param *, bool);
@@ -175,8 +183,34 @@ LUAXTABLE_DESTROYER_CB(target, tg, targ, LUAXTABLE_TTARGET);
 
 static void luaxtable_release(void *private);
 
+static void luaxtable_setops(lua_State *L, int idx, luaxtable_t *xtable)
+{
+	luaxtable_op_t op;
+
+	lunatik_checkfield(L, idx, "checkentry", LUA_TFUNCTION);
+	lunatik_checkfield(L, idx, "destroy", LUA_TFUNCTION);
+	lunatik_checkfield(L, idx, luaxtable_opname(xtable, LUAXTABLE_OHOOK), LUA_TFUNCTION);
+	lua_pop(L, 3); /* checkentry, destroy, hook */
+
+	for (op = 0; op < LUAXTABLE_NOPS; op++)
+		lunatik_setfieldref(L, idx, luaxtable_opname(xtable, op), &xtable->ops[op]);
+}
+
+LUNATIK_OBJECTCHECKER(luaxtable_check, luaxtable_t *);
+
+static int luaxtable_update(lua_State *L)
+{
+	luaxtable_t *xtable = luaxtable_check(L, 1);
+
+	lunatik_checkupdate(L, xtable->runtime);
+	luaxtable_setops(L, 2, xtable);
+	lunatik_setregistry(L, 2, xtable); /* ops */
+	return 0;
+}
+
 static const luaL_Reg luaxtable_mt[] = {
 	{"__gc", lunatik_deleteobject},
+	{"update", luaxtable_update},
 	{NULL, NULL}
 };
 
@@ -192,9 +226,12 @@ static inline lunatik_object_t *luaxtable_new(lua_State *L, int idx, int hook)
 	luaL_checktype(L, idx, LUA_TTABLE);
 	lunatik_object_t *object = lunatik_newobject(L, &luaxtable_class , sizeof(luaxtable_t));
 	luaxtable_t *xtable = (luaxtable_t *)object->private;
+	luaxtable_op_t op;
 
 	xtable->type = hook;
 	xtable->runtime = NULL;
+	for (op = 0; op < LUAXTABLE_NOPS; op++)
+		xtable->ops[op] = LUA_NOREF;
 	luanetfilter_newbuffer(L, idx, xtable, skb);
 	return object;
 }
@@ -220,9 +257,7 @@ static int luaxtable_new##hook(lua_State *L) 				\
 	lunatik_setinteger(L, 1, hook, family);			\
 	lunatik_setinteger(L, 1, hook, proto);			\
 	lunatik_setinteger(L, 1, hook, hooks);			\
-	lunatik_checkfield(L, 1, "checkentry", LUA_TFUNCTION);		\
-	lunatik_checkfield(L, 1, "destroy", LUA_TFUNCTION);		\
-	lunatik_checkfield(L, 1, #hook, LUA_TFUNCTION);			\
+	luaxtable_setops(L, 1, xtable);					\
 									\
 	hook->usersize = 0;						\
 	hook->hook##size = sizeof(luaxtable_info_t);			\
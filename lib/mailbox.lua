@@ -1,54 +1,38 @@
 --
 -- SPDX-FileCopyrightText: (c) 2024 Ring Zero Desenvolvimento de Software LTDA
--- SPDX-License-Identifier: MIT OR GPL-2.0-only 
+-- SPDX-License-Identifier: MIT OR GPL-2.0-only
 --
 
-local fifo       = require("fifo")
-local completion = require("completion")
+local fifo = require("fifo")
 
-local mailbox = {} 
+local mailbox = {}
 local MailBox = {}
 MailBox.__index = MailBox
 
-local function new(q, e, allowed, forbidden)
+-- q is either the queue size or a fifo shared with another mailbox;
+-- a shared fifo must be created in record mode, i.e., fifo.new(size, true)
+local function new(q, allowed, forbidden)
 	local mbox = {}
-	if type(q) == 'userdata' then
-		mbox.queue, mbox.event = q, e
-	else
-		mbox.queue, mbox.event = fifo.new(q), completion.new()
-	end
+	mbox.queue = type(q) == 'userdata' and q or fifo.new(q, true) -- record mode
 	mbox[forbidden] = function () error(allowed .. "-only mailbox") end
 	return setmetatable(mbox, MailBox)
 end
 
-function mailbox.inbox(q, e)
-	return new(q, e, 'receive', 'send')
+function mailbox.inbox(q)
+	return new(q, 'receive', 'send')
 end
 
-function mailbox.outbox(q, e)
-	return new(q, e, 'send', 'receive')
+function mailbox.outbox(q)
+	return new(q, 'send', 'receive')
 end
 
-local sizeoft = string.packsize("T")
-function MailBox:receive()
-	local ok, err = self.event:wait()
-	if not ok then error(err) end
-
-	local queue = self.queue
-	local header, header_size = queue:pop(sizeoft)
-
-	if header_size == 0 then
-		return nil
-	elseif header_size < sizeoft then
-		error("malformed message")
-	end
-
-	return queue:pop(string.unpack("T", header))
+function MailBox:receive(timeout)
+	local message, size = self.queue:pop(nil, timeout or -1)
+	return size > 0 and message or nil
 end
 
 function MailBox:send(message)
-	self.queue:push(string.pack("s", message))
-	self.event:complete()
+	self.queue:push(message)
 end
 
 return mailbox
@@ -0,0 +1,120 @@
+--
+-- SPDX-FileCopyrightText: (c) 2024 Ring Zero Desenvolvimento de Software LTDA
+-- SPDX-License-Identifier: MIT OR GPL-2.0-only
+--
+
+local socket = require("socket")
+local thread = require("thread")
+local linux  = require("linux")
+
+local event = socket.event
+local again = linux.errno.AGAIN
+local inprogress = linux.errno.INPROGRESS
+local shouldstop = thread.shouldstop
+local yield = coroutine.yield
+
+local async = {}
+local Scheduler = {}
+Scheduler.__index = Scheduler
+
+function async.new()
+	local scheduler = {poll = socket.poll(), ready = {}, waiting = {}, tasks = 0, id = 0}
+	return setmetatable(scheduler, Scheduler)
+end
+
+function Scheduler:spawn(f, ...)
+	local task = table.pack(coroutine.create(f), ...)
+	table.insert(self.ready, task)
+	self.tasks = self.tasks + 1
+end
+
+function Scheduler:resume(co, ...)
+	local ok, sock, events = coroutine.resume(co, ...)
+	if not ok then
+		print("async: " .. tostring(sock))
+	end
+
+	if coroutine.status(co) == "dead" then
+		self.tasks = self.tasks - 1
+	elseif sock then -- blocked on socket
+		local id = self.id + 1
+		self.id = id
+		self.waiting[id] = co
+		self.poll:add(sock.socket or sock, id, events)
+	else -- voluntary yield
+		table.insert(self.ready, {co, n = 1})
+	end
+end
+
+function Scheduler:run()
+	local poll, waiting = self.poll, self.waiting
+	while self.tasks > 0 and not shouldstop() do
+		local ready = self.ready
+		self.ready = {}
+		for _, task in ipairs(ready) do
+			self:resume(table.unpack(task, 1, task.n))
+		end
+
+		if next(waiting) then
+			local timeout = #self.ready > 0 and 0 or nil -- don't sleep if there are runnable tasks
+			for id, events in pairs(poll:wait(timeout)) do
+				local co = waiting[id]
+				waiting[id] = nil
+				poll:remove(id)
+				self:resume(co, events)
+			end
+		end
+	end
+end
+
+function Scheduler:close()
+	self.poll:close()
+end
+
+Scheduler.__close = Scheduler.close
+
+function async.wait(sock, events)
+	return yield(sock, events or event.IN)
+end
+
+function async.yield()
+	yield()
+end
+
+local function try(sock, events, method, ...)
+	while true do
+		local result = table.pack(pcall(sock[method], sock, ...))
+		if result[1] then
+			return table.unpack(result, 2, result.n)
+		elseif result[2] ~= again then
+			error(result[2])
+		end
+		async.wait(sock, events)
+	end
+end
+
+function async.accept(sock, flags)
+	return try(sock, event.IN, "accept", flags)
+end
+
+function async.receive(sock, ...)
+	return try(sock, event.IN, "receive", ...)
+end
+
+function async.send(sock, ...)
+	return try(sock, event.OUT, "send", ...)
+end
+
+function async.connect(sock, ...)
+	local ok, err = pcall(sock.connect, sock, ...)
+	if not ok then
+		if err ~= inprogress then
+			error(err)
+		end
+		async.wait(sock, event.OUT)
+		sock:getpeername() -- raises if the connection has failed
+	end
+end
+
+return async
+
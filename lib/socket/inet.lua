@@ -38,9 +38,9 @@ function inet:new(o)
 end
 
 local af = socket.af
-function inet:__call()
+function inet:__call(flags)
 	local o = self:new()
-	o.socket = socket.new(af.INET, self.type, self.proto)
+	o.socket = socket.new(af.INET, self.type | (flags or 0), self.proto)
 	return o
 end
 
@@ -92,6 +92,42 @@ function inet.tcp:accept(flags)
 	return self.socket:accept(flags)
 end
 
+local sol, so = socket.sol, socket.so
+function inet.tcp.shard(script, addr, port, n, flags)
+	local lunatik = require("lunatik")
+	local thread  = require("thread")
+	local cpus = thread.cpus()
+	n = n or #cpus
+	assert(n > 0 and n <= #cpus, "invalid number of CPUs")
+
+	local servers, threads = {}, {}
+	local ok, err = pcall(function ()
+		for i = 1, n do
+			local cpu = cpus[i]
+			local server = inet.tcp(flags)
+			servers[i] = server
+			server.socket:setopt(sol.SOCKET, so.REUSEPORT, true)
+			server:bind(addr, port)
+			server:listen()
+
+			local runtime = lunatik.runtime(script)
+			runtime:resume(server.socket, cpu)
+			threads[i] = thread.run(runtime, script .. "/" .. cpu, {cpu = cpu})
+		end
+	end)
+
+	if not ok then -- don't leave a partial service behind
+		for _, t in ipairs(threads) do
+			t:stop()
+		end
+		for _, server in ipairs(servers) do
+			server:close()
+		end
+		error(err)
+	end
+	return threads
+end
+
 inet.udp = inet:new{type = sock.DGRAM, proto = ipproto.UDP}
 
 function inet.udp:receivefrom(len, flags)
@@ -266,7 +266,10 @@ do {								\
 static inline T checker(lua_State *L, int ix)			\
 {								\
 	lunatik_object_t *object = lunatik_checkobject(L, ix);	\
-	return (T)object->private;				\
+	T private = (T)object->private;				\
+	/* avoid use-after-free */				\
+	lunatik_argchecknull(L, private, ix);			\
+	return private;						\
 }
 
 #define LUNATIK_PRIVATECHECKER(checker, T)			\
@@ -286,6 +289,34 @@ static inline void lunatik_setregistry(lua_State *L, int ix, void *key)
 	lua_rawsetp(L, LUA_REGISTRYINDEX, key); /* pop value */
 }
 
+#define lunatik_getref(L, ref)	lua_rawgeti((L), LUA_REGISTRYINDEX, (ref))
+
+static inline void lunatik_setref(lua_State *L, int ix, int *ref)
+{
+	luaL_unref(L, LUA_REGISTRYINDEX, *ref);
+	lua_pushvalue(L, ix);
+	*ref = luaL_ref(L, LUA_REGISTRYINDEX); /* pop value */
+}
+
+static inline void lunatik_setfieldref(lua_State *L, int ix, const char *field, int *ref)
+{
+	lua_getfield(L, ix, field);
+	lunatik_setref(L, -1, ref);
+	lua_pop(L, 1); /* field */
+}
+
+static inline void lunatik_unref(lua_State *L, int *ref)
+{
+	luaL_unref(L, LUA_REGISTRYINDEX, *ref);
+	*ref = LUA_NOREF; /* refs are recycled by the registry */
+}
+
+static inline void lunatik_checkupdate(lua_State *L, lunatik_object_t *runtime)
+{
+	luaL_checktype(L, 2, LUA_TTABLE);
+	luaL_argcheck(L, lunatik_toruntime(L) == runtime, 1, "cannot update from another runtime");
+}
+
 static inline void lunatik_registerobject(lua_State *L, int ix, lunatik_object_t *object)
 {
 	lunatik_setregistry(L, ix, object->private); /* private */